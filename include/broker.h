@@ -1,14 +1,27 @@
 #ifndef SPECTACLES_INCLUDE_BROKER_H_
 #define SPECTACLES_INCLUDE_BROKER_H_
 
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
 #include <string>
 #include <set>
+#include <thread>
 #include <vector>
 
 #include <amqp.h>
 #include <amqp_tcp_socket.h>
 
+#include "buffer.h"
+#include "dispatch.h"
 #include "gateway.h"
+#include "metrics.h"
+#include "queue.h"
+#include "spill.h"
 
 /// \brief The spectacles namespace.
 ///
@@ -26,6 +39,16 @@ enum error_type {
   BROKER_AMQP_STATUS_ERROR,
   BROKER_RPC_ERROR,
   BROKER_TCP_SOCKET_ERROR,
+  BROKER_SPILL_ERROR,
+  BROKER_NACK_ERROR,
+  BROKER_CLOSED_ERROR,
+  BROKER_TRANSPORT_ERROR,
+};
+
+/// What a Consumer with a DispatchPool keeps messages in order by.
+enum order_key {
+  ORDER_BY_ROUTING_KEY,
+  ORDER_BY_GUILD,
 };
 
 /// A broker error.
@@ -36,18 +59,159 @@ struct Error {
   std::string context;
 };
 
+/// \brief Where and when a message entered the system, carried in its AMQP headers from a Publisher to a Consumer.
+///
+/// The headers are received_at, shard_id and sequence. They are left out when the packet wasn't received by a
+/// gateway::Connection.
+struct Trace {
+  /// When the gateway payload was received, in microseconds since the epoch, or 0 if unknown.
+  int64_t received = 0;
+
+  /// The shard the payload was received on, or -1 if unknown.
+  int32_t shard = -1;
+
+  /// The gateway sequence number, or -1 if unknown.
+  int32_t sequence = -1;
+};
+
+/// \brief Picks the partition a guild's events are routed through, with a jump consistent hash.
+///
+/// Going from n to n + 1 partitions only moves about 1 / (n + 1) of the guilds, all of them into the new partition.
+///
+/// \param[in] guild      - The guild id, or 0 for events outside of a guild.
+/// \param[in] partitions - The number of partitions.
+/// \returns The partition, from 0 to partitions - 1.
+int32_t partitionOf(uint64_t guild, int32_t partitions);
+
+/// A message taken from a Transport.
+struct Envelope {
+  /// The routing key.
+  std::string key;
+
+  /// The message body, valid until the next call to Subscription#next.
+  const char *body = nullptr;
+
+  /// The size of Envelope#body.
+  size_t length = 0;
+};
+
+/// A reader of the messages published to a Transport under a set of routing keys.
+class Subscription {
+ public:
+  virtual ~Subscription() { }
+
+  /// \brief Takes the next message.
+  ///
+  /// \param[out] out     - The message.
+  /// \param[in]  timeout - How long to wait for a message, in milliseconds.
+  /// \returns false if no message came in time.
+  virtual bool next(Envelope *out, int timeout) = 0;
+
+  /// The number of messages that were missed because the reader fell behind.
+  virtual uint64_t dropped() const = 0;
+};
+
+/// \brief A way of moving messages from a Publisher to Consumers other than an AMQP broker.
+///
+/// Publisher#useTransport and Consumer#consume put one under the usual encoding, batching, compression and handler
+/// dispatch; without one, both talk AMQP to the broker directly.
+class Transport {
+ public:
+  virtual ~Transport() { }
+
+  /// \brief Publishes a message.
+  ///
+  /// \param[in] key    - The routing key.
+  /// \param[in] body   - The message body.
+  /// \param[in] length - The size of body.
+  /// \returns 0 if successful.
+  virtual Error publish(const std::string &key, const char *body, size_t length) = 0;
+
+  /// \brief Starts reading the messages published from now on.
+  ///
+  /// \param[in] keys - The routing keys to read, or an empty list for every message.
+  /// \returns nullptr if the transport can't be read from.
+  virtual std::unique_ptr<Subscription> subscribe(const std::vector<std::string> &keys) = 0;
+};
+
 /// A connection used solely to publish messages.
 class Publisher {
  private:
-  amqp_connection_state_t conn;
+  amqp_connection_state_t conn = nullptr;
+  std::string hostname;
+  int port = 0;
   std::string group;
   std::set<std::string> events;
+  metrics::Registry *registry = nullptr;
+  metrics::Counter *errorMetric = nullptr;
+  Histogram *latencyMetric = nullptr;
+  metrics::Gauge *spilledMetric = nullptr;
+  std::map<std::string, std::pair<metrics::Counter *, metrics::Counter *>> eventMetrics;
+
+  std::unique_ptr<SpillQueue> queue;
+  std::atomic<bool> draining{false};
+  std::thread drainer;
+
+  struct Outgoing {
+    std::string key;
+    std::string body;
+    std::function<void(Error)> done;
+    int64_t queued;
+    Trace trace;
+  };
+
+  struct Batch {
+    std::string body;
+    uint32_t count = 0;
+    int64_t deadline = 0;
+    Trace trace;
+    std::vector<std::function<void(Error)>> done;
+  };
+
+  size_t batchBytes = 0;
+  int batchDelay = 0;
+  std::set<std::string> batchEvents;
+  std::map<std::string, Batch> batches;
+  std::mutex batchMutex;
+  std::condition_variable batchReady;
+  bool batching = false;
+  std::thread batcher;
+  std::mutex sendMutex;
+  Transport *transport = nullptr;
+  int32_t partitions = 0;
+
+  size_t compressThreshold = 0;
+  int compressLevel = -1;
+  Histogram *compressMetric = nullptr;
+  metrics::Counter *compressInMetric = nullptr;
+  metrics::Counter *compressOutMetric = nullptr;
+
+  size_t window = 0;
+  size_t outstanding = 0;
+  mutable std::mutex outgoingMutex;
+  std::condition_variable outgoingReady;
+  std::condition_variable outgoingSpace;
+  std::deque<Outgoing> outgoing;
+  std::map<uint64_t, Outgoing> inflight;
+  uint64_t nextTag = 1;
+
+  void count(const std::string &key, size_t bytes);
+  Error open();
+  void disconnect();
+  Error send(const std::string &event, amqp_bytes_t body, const Trace &trace = Trace());
+  void drain();
+  void pump();
+  void collect();
+  Error emit(const std::string &event, const std::string &body, std::function<void(Error)> done, const Trace &trace);
+  Error flush(const std::string &event, Batch *batch);
+  void complete(uint64_t tag, bool multiple, Error err);
+  void finish(std::vector<Outgoing> *done, Error err);
 
  public:
   /// Creates a new publisher.
   Publisher() { }
 
-  /// Closes the connection.
+  /// Stops draining or pipelining and closes the connection. Unconfirmed messages are done with BROKER_CLOSED_ERROR.
   ~Publisher();
 
   /// \brief Connects to the broker.
@@ -61,9 +225,247 @@ class Publisher {
 
   /// \brief Publishes a message.
   ///
+  /// With Publisher#spill, the message is only queued and this never blocks on the broker.
+  ///
   /// \param[in] packet - The packet to send.
   /// \returns 0 if successful.
   Error publish(gateway::Packet packet);
+
+  /// \brief Publishes a message without copying it into a Packet first.
+  ///
+  /// The event data is taken straight from PacketView#raw when it's there, so it's neither decoded nor re-encoded.
+  /// PacketView#received, PacketView#shard and PacketView#s go along as the message's Trace. A batch carries the
+  /// Trace of its first event.
+  ///
+  /// \param[in] packet - The packet to send.
+  /// \returns 0 if successful.
+  Error publish(const gateway::PacketView &packet);
+
+  /// \brief Publishes a message and reports when the broker has taken responsibility for it.
+  ///
+  /// Without Publisher#pipeline the message is published straight away and done is called before returning.
+  ///
+  /// \param[in] packet - The packet to send.
+  /// \param[in] done   - Called with the outcome, which may be from another thread. May be empty.
+  /// \returns 0 if the message was accepted, which is before it's confirmed when pipelining.
+  Error publish(const gateway::PacketView &packet, std::function<void(Error)> done);
+
+  /// \brief Publishes from a thread of its own, with publisher confirms.
+  ///
+  /// The channel is put in confirm mode and a thread publishes queued messages in batches, keeping up to window of
+  /// them unconfirmed at once. Publisher#publish blocks while the window is full. A message is only done once the
+  /// broker acks or nacks it; when the connection drops, everything unconfirmed is published again on a new one, so
+  /// delivery is at least once. Call after Publisher#connect, and not together with Publisher#spill.
+  ///
+  /// \param[in] window - The most messages queued or awaiting confirmation at once.
+  /// \returns false if the publisher is already pipelining or spilling.
+  bool pipeline(size_t window = 1024);
+
+  /// \brief Queues messages instead of publishing them on the caller's thread.
+  ///
+  /// Messages go through a SpillQueue which holds up to capacity messages in memory and spills the rest to segment
+  /// files in the directory. A thread publishes them in order, and when the broker fails it reconnects with backoff
+  /// and retries the same message, so nothing is lost while the broker is slow or down. Spilled messages are published
+  /// without a Trace. Call after Publisher#connect.
+  ///
+  /// \param[in] directory   - Where to spill to, which should be unique to this publisher.
+  /// \param[in] capacity    - The number of messages held in memory.
+  /// \param[in] segmentSize - The size of each spill file, in bytes.
+  /// \returns false if the directory could not be opened.
+  bool spill(const std::string &directory, size_t capacity = 65536, size_t segmentSize = 64 * 1024 * 1024);
+
+  /// \brief Packs events with the same name into one message.
+  ///
+  /// The event data of each one is appended to a pending batch for its event name, which is published as a single
+  /// message once it reaches bytes in size or delay after its first event. A batch is encoded as the tuple
+  /// {batch, [d, ...]}, which a Consumer unpacks on its own, so handlers still see one event at a time. Done
+  /// callbacks run once the batch is done. Works with plain publishing, Publisher#spill and Publisher#pipeline, and
+  /// must be called after Publisher#connect and either of those.
+  ///
+  /// \param[in] bytes  - The size a batch is published at.
+  /// \param[in] delay  - The longest an event waits in a batch, in milliseconds.
+  /// \param[in] events - The events to batch, or an empty set to batch all of them.
+  /// \returns false if the publisher is already batching.
+  bool batch(size_t bytes = 64 * 1024, int delay = 10, std::set<std::string> events = std::set<std::string>());
+
+  /// \brief Publishes through a transport instead of the broker.
+  ///
+  /// Can be used instead of Publisher#connect, as well as Publisher#batch and Publisher#compress, but not together
+  /// with Publisher#spill or Publisher#pipeline.
+  ///
+  /// \param[in] transport - The transport, which must outlive the publisher, or nullptr to publish to the broker.
+  void useTransport(Transport *transport);
+
+  /// \brief Routes each event through one of several partitions, picked by guild.
+  ///
+  /// Messages are published with EVENT.partition as routing key, the partition being partitionOf the event's guild id,
+  /// so consumers that bind to separate ranges of partitions with Consumer#partition split the events between them
+  /// while every guild's events still reach one consumer in order. Events without a guild id go to partition 0.
+  ///
+  /// \param[in] partitions - The number of partitions, or 0 to route by event name alone.
+  void partition(int32_t partitions);
+
+  /// \brief Compresses large messages.
+  ///
+  /// Bodies of at least threshold bytes, batches included, are sent as an etf COMPRESSED term, which holds the
+  /// zlib-deflated term and is understood by etf decoders as is. A body is only replaced when compressing made it
+  /// smaller. Consumers inflate compressed bodies before handling them.
+  ///
+  /// \param[in] threshold - The smallest body to compress, in bytes, or 0 to stop compressing.
+  /// \param[in] level     - The zlib compression level, from 1 to 9, or -1 for the default.
+  void compress(size_t threshold = 64 * 1024, int level = -1);
+
+  /// The number of messages waiting to be published or confirmed by Publisher#spill or Publisher#pipeline.
+  size_t pending() const;
+
+  /// \brief Reports published messages and bytes per event, publish latency, publish errors and compression to a
+  /// registry.
+  ///
+  /// Metrics are labelled with the exchange, so this is best called before Publisher#connect.
+  ///
+  /// \param[in] registry - The registry to report to, or nullptr to stop reporting.
+  void useMetrics(metrics::Registry *registry);
+};
+
+/// \brief A few connections with several channels each, shared by any number of publishing threads.
+///
+/// Every connection is driven by a thread of its own. Publishing only encodes the message and pushes it onto that
+/// connection's lock-free queue, so shards never wait on each other or on the broker. Messages with the same key go
+/// over the same channel and stay in order; when the connection fails they are retried on a new one with backoff.
+class PublisherPool {
+ private:
+  struct Message {
+    std::string key;
+    std::string body;
+    uint16_t channel = 1;
+    int64_t queued = 0;
+    Trace trace;
+  };
+
+  struct Link {
+    amqp_connection_state_t conn = nullptr;
+    MPSCQueue<Message> queue;
+    std::atomic<bool> asleep{false};
+    std::mutex mutex;
+    std::condition_variable wake;
+    std::thread thread;
+    std::map<std::string, std::pair<metrics::Counter *, metrics::Counter *>> eventMetrics;
+  };
+
+  size_t channels;
+  std::vector<std::unique_ptr<Link>> links;
+  std::atomic<bool> running{false};
+  std::atomic<size_t> queued{0};
+  std::atomic<uint64_t> nextKey{0};
+  std::string hostname;
+  int port = 0;
+  std::string group;
+  std::set<std::string> events;
+  int32_t partitions = 0;
+  metrics::Registry *registry = nullptr;
+  metrics::Counter *errorMetric = nullptr;
+  Histogram *latencyMetric = nullptr;
+
+  void run(Link *link);
+  bool send(Link *link, const Message &m);
+
+ public:
+  /// \brief Creates a pool.
+  ///
+  /// \param[in] connections - The number of connections, each with a thread of its own.
+  /// \param[in] channels    - The number of channels on each connection.
+  explicit PublisherPool(size_t connections = 2, size_t channels = 4);
+
+  PublisherPool(const PublisherPool &) = delete;
+  PublisherPool &operator=(const PublisherPool &) = delete;
+
+  /// Publishes whatever is still queued, if connected, then closes every connection.
+  ~PublisherPool();
+
+  /// \brief Connects every connection to the broker and starts their threads.
+  ///
+  /// \param[in] hostname - The server hostname.
+  /// \param[in] port     - The server port.
+  /// \param[in] exchange - The exchange to publish to.
+  /// \param[in] events   - The events to send out, or an empty set to let everything through.
+  /// \returns 0 if successful.
+  Error connect(std::string hostname, int port, std::string exchange = "direct", std::set<std::string> events = std::set<std::string>());
+
+  /// \brief Queues a message on the channel picked by key. Safe to call from any number of threads.
+  ///
+  /// \param[in] packet - The packet to send.
+  /// \param[in] key    - Messages with the same key, such as a shard id, are published in order.
+  /// \returns 0 if the message was queued.
+  Error publish(const gateway::PacketView &packet, uint64_t key);
+
+  /// \brief Queues a message on the next channel in turn.
+  ///
+  /// \param[in] packet - The packet to send.
+  /// \returns 0 if the message was queued.
+  Error publish(const gateway::PacketView &packet);
+
+  /// \brief Routes each event through one of several partitions, picked by guild, like Publisher#partition.
+  ///
+  /// \param[in] partitions - The number of partitions, or 0 to route by event name alone.
+  void partition(int32_t partitions);
+
+  /// The number of messages queued but not yet published.
+  size_t pending() const;
+
+  /// \brief Reports published messages and bytes per event, queueing latency and publish errors to a registry.
+  ///
+  /// Must be called before PublisherPool#connect.
+  ///
+  /// \param[in] registry - The registry to report to, or nullptr to not report.
+  void useMetrics(metrics::Registry *registry);
+};
+
+class Consumer;
+
+/// \brief A handle to settle a message consumed with Consumer#acknowledge.
+///
+/// Handles are cheap to copy and may be settled from any thread, as long as the consumer is still alive. Every
+/// delivery has to be settled exactly once, as acknowledgements only move past messages that have all been settled.
+/// Settling a message from before the consumer reconnected does nothing, as the broker has already requeued it.
+class Delivery {
+ private:
+  struct Parts {
+    std::atomic<size_t> remaining;
+    std::atomic<bool> rejected{false};
+    std::atomic<bool> requeue{false};
+
+    explicit Parts(size_t count) : remaining(count) { }
+  };
+
+  Consumer *consumer = nullptr;
+  uint64_t tag = 0;
+  uint64_t generation = 0;
+  std::shared_ptr<Parts> parts;
+
+  Delivery(Consumer *consumer_, uint64_t tag_, uint64_t generation_, std::shared_ptr<Parts> parts_ = nullptr)
+      : consumer(consumer_), tag(tag_), generation(generation_), parts(parts_) { }
+
+  friend class Consumer;
+
+ public:
+  Delivery() { }
+
+  /// The delivery tag, or 0 when the message does not need settling.
+  uint64_t deliveryTag() const {
+    return tag;
+  }
+
+  /// \brief Marks the message as handled.
+  ///
+  /// For an event from a batch, the message is only settled once every event in it is.
+  void ack() const;
+
+  /// \brief Rejects the message.
+  ///
+  /// For an event from a batch, the whole batch is rejected once every event in it is settled.
+  ///
+  /// \param[in] requeue - Whether the broker should deliver the message again.
+  void nack(bool requeue = true) const;
 };
 
 /// \brief A connection used solely to consume messages.
@@ -74,8 +476,51 @@ class Consumer {
   bool open = true;
   std::function<void(Error)> errorHandler;
   std::function<void(std::string, gateway::Packet)> messageHandler;
+  std::function<void(const std::string &, const gateway::PacketView &)> viewHandler;
+  std::string group;
+  metrics::Registry *registry = nullptr;
+  Histogram *decodeMetric = nullptr;
+  Histogram *inflateMetric = nullptr;
+  metrics::Counter *inflateInMetric = nullptr;
+  metrics::Counter *inflateOutMetric = nullptr;
+  std::vector<char> inflated;
+  std::function<void(const std::string &, const gateway::PacketView &, Delivery)> deliveryHandler;
+  std::map<std::string, std::pair<metrics::Counter *, metrics::Counter *>> eventMetrics;
+
+  uint16_t prefetch = 0;
+  size_t ackBatch = 64;
+  int ackInterval = 100;
+  std::mutex ackMutex;
+  std::map<uint64_t, bool> settled;
+  std::vector<std::pair<uint64_t, bool>> nacks;
+  uint64_t settledTag = 0;
+  uint64_t ackTag = 0;
+  uint64_t ackedTag = 0;
+  int64_t lastAck = 0;
+  std::atomic<uint64_t> generation{0};
+
+  DispatchPool *pool = nullptr;
+  order_key order = ORDER_BY_ROUTING_KEY;
+  bool lazy = false;
+
+  int32_t partitions = 0;
+  int32_t firstPartition = 0;
+  int32_t lastPartition = 0;
+
+  std::mutex latencyMutex;
+  std::map<std::string, Histogram *> latencyMetrics;
 
-  void handleMessage(amqp_bytes_t, amqp_message_t);
+  void count(const std::string &event, size_t bytes);
+  void trackMetrics();
+  void measure(const std::string &event, const Trace &trace);
+  std::vector<std::string> bindings(const std::vector<std::string> &events) const;
+  void handleMessage(const std::string &key, const char *body, size_t length, uint64_t tag, const Trace &trace);
+  void dispatch(const std::string &event, const char *body, size_t length, Delivery delivery, const Trace &trace);
+  void deliver(const std::string &event, const char *body, size_t length, Delivery delivery, const Trace &trace);
+  void settle(uint64_t tag, uint64_t generation, bool ack, bool requeue);
+  bool flushAcks(amqp_connection_state_t conn, bool force);
+
+  friend class Delivery;
 
  public:
   /// Creates a new consumer.
@@ -93,11 +538,89 @@ class Consumer {
   /// \returns 0 if successful.
   Error connect(std::string hostname, int port, std::string exchange = "direct", std::vector<std::string> events = std::vector<std::string>(0));
 
+  /// \brief Consumes from a transport instead of the broker.
+  ///
+  /// Messages go through the same handlers, dispatch pool and unbatching as with Consumer#connect; there is nothing to
+  /// acknowledge.
+  ///
+  /// \param[in] transport - The transport, which must outlive the consumer.
+  /// \param[in] events    - The events to subscribe to.
+  /// \returns 0 if successful.
+  Error consume(Transport *transport, std::vector<std::string> events = std::vector<std::string>(0));
+
   /// \brief Called when a new message is received.
   ///
   /// \param[in] handler - The event handler.
   void onMessage(std::function<void(std::string, gateway::Packet)> handler);
 
+  /// \brief Called when a new message is received, without copying it.
+  ///
+  /// The view borrows the AMQP frame buffer and is only valid until the handler returns.
+  ///
+  /// \param[in] handler - The event handler.
+  void onMessage(std::function<void(const std::string &, const gateway::PacketView &)> handler);
+
+  /// \brief Called when a new message is received, with a handle to settle it.
+  ///
+  /// Only useful with Consumer#acknowledge; otherwise the handle does nothing. The message must be settled through the
+  /// handle, but that may happen after the handler returns.
+  ///
+  /// \param[in] handler - The event handler.
+  void onMessage(std::function<void(const std::string &, const gateway::PacketView &, Delivery)> handler);
+
+  /// \brief Only lets the broker drop messages once they are handled.
+  ///
+  /// Limits the broker to prefetch unacknowledged messages at once and consumes in manual acknowledgement mode. A
+  /// message is settled when its handler returns, or through its Delivery handle. Acknowledgements are sent as one
+  /// cumulative ack for every message settled in order, once batch of them have been or after interval, so a crash
+  /// loses nothing that wasn't handled. Must be called before Consumer#connect.
+  ///
+  /// \param[in] prefetch - The most unacknowledged messages the broker will send.
+  /// \param[in] batch    - The number of settled messages that are acknowledged at once.
+  /// \param[in] interval - The longest acknowledgements are held back for, in milliseconds.
+  void acknowledge(uint16_t prefetch = 256, size_t batch = 64, int interval = 100);
+
+  /// \brief Hands messages to view handlers without decoding them.
+  ///
+  /// Views borrow the message body and only read the opcode, sequence and event name from it; the event data is
+  /// decoded on the first call to PacketView#data. Handlers that only forward PacketView#raw never decode at all.
+  /// Packet handlers still get decoded data. Must be called before Consumer#connect.
+  ///
+  /// \param[in] lazy - Whether to decode lazily.
+  void decodeLazily(bool lazy = true);
+
+  /// \brief Runs handlers on a pool of threads instead of the consumer thread.
+  ///
+  /// Each message is copied and handed to the pool, keyed so messages with the same routing key or guild are handled
+  /// one at a time and in order, while the rest run in parallel. Messages without a guild id all share one key. With
+  /// Consumer#acknowledge, a message is only acknowledged once its handlers have returned. Handlers must be safe to
+  /// call from several threads at once, and the pool must outlive the consumer. Must be called before
+  /// Consumer#connect.
+  ///
+  /// \param[in] pool  - The pool to run handlers on, or nullptr to run them on the consumer thread.
+  /// \param[in] order - What to keep messages in order by.
+  void useDispatchPool(DispatchPool *pool, order_key order = ORDER_BY_ROUTING_KEY);
+
+  /// \brief Takes a range of the partitions events are routed through by Publisher#partition.
+  ///
+  /// Every event is bound once for each partition in the range, and handlers are still given the plain event name.
+  /// Consumers that take ranges which together cover every partition each get a share of the guilds, with all of a
+  /// guild's events going to the same one. Must be called before Consumer#connect.
+  ///
+  /// \param[in] partitions - The number of partitions the publisher routes through, or 0 to bind event names alone.
+  /// \param[in] first      - The first partition to take.
+  /// \param[in] last       - The last partition to take, or -1 for the last one there is.
+  void partition(int32_t partitions, int32_t first = 0, int32_t last = -1);
+
+  /// \brief Reports consumed messages and bytes per event, decode time and decompression to a registry.
+  ///
+  /// For messages that carry a Trace, the time from the gateway receiving them to their handlers being called is
+  /// reported per event as well. It's measured against the wall clock, so it's only as accurate as the clocks of the
+  /// gateway and consumer hosts are in sync. Must be called before Consumer#connect.
+  ///
+  /// \param[in] registry - The registry to report to, or nullptr to not report.
+  void useMetrics(metrics::Registry *registry);
+
   /// \brief Called when there is an error;
   //
   /// \param[in] handler - The event handler.
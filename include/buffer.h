@@ -0,0 +1,110 @@
+#ifndef SPECTACLES_INCLUDE_BUFFER_H_
+#define SPECTACLES_INCLUDE_BUFFER_H_
+
+#include <atomic>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+
+/// \brief The spectacles namespace.
+///
+/// Everything public facing is under this namespace.
+namespace spectacles {
+
+/// \brief An immutable, reference counted byte buffer.
+///
+/// The bytes are copied once when the buffer is created. Copying the buffer afterwards only bumps a reference
+/// count, so it can be handed between threads cheaply.
+class Buffer {
+ private:
+  struct Block {
+    std::atomic<int> refs;
+    size_t length;
+    char bytes[1];
+  };
+
+  Block *block = nullptr;
+
+  void release() {
+    if (block && block->refs.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+      block->~Block();
+      free(block);
+    }
+
+    block = nullptr;
+  }
+
+ public:
+  /// Creates an empty buffer.
+  Buffer() { }
+
+  /// \brief Copies bytes into a new buffer.
+  ///
+  /// \param[in] data   - The bytes to copy.
+  /// \param[in] length - The number of bytes.
+  Buffer(const char *data, size_t length) {
+    void *memory = malloc(sizeof(Block) + length);
+    if (!memory) {
+      throw std::bad_alloc();
+    }
+
+    block = new (memory) Block();
+    block->refs.store(1, std::memory_order_relaxed);
+    block->length = length;
+    memcpy(block->bytes, data, length);
+  }
+
+  Buffer(const Buffer &b) : block(b.block) {
+    if (block) {
+      block->refs.fetch_add(1, std::memory_order_relaxed);
+    }
+  }
+
+  Buffer(Buffer &&b) : block(b.block) {
+    b.block = nullptr;
+  }
+
+  Buffer &operator=(const Buffer &b) {
+    if (b.block) {
+      b.block->refs.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    release();
+    block = b.block;
+    return *this;
+  }
+
+  Buffer &operator=(Buffer &&b) {
+    if (this != &b) {
+      release();
+      block = b.block;
+      b.block = nullptr;
+    }
+
+    return *this;
+  }
+
+  /// Drops this reference, freeing the bytes if it was the last one.
+  ~Buffer() {
+    release();
+  }
+
+  /// The bytes, or nullptr if the buffer is empty.
+  const char *data() const {
+    return block ? block->bytes : nullptr;
+  }
+
+  /// The number of bytes.
+  size_t size() const {
+    return block ? block->length : 0;
+  }
+
+  /// Whether the buffer holds no bytes.
+  bool empty() const {
+    return size() == 0;
+  }
+};
+
+}  // namespace spectacles
+
+#endif  // SPECTACLES_INCLUDE_BUFFER_H_
@@ -0,0 +1,744 @@
+#ifndef SPECTACLES_INCLUDE_CACHE_H_
+#define SPECTACLES_INCLUDE_CACHE_H_
+
+#include <sys/types.h>
+
+#include <atomic>
+#include <cinttypes>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+#include "etf/scanner.h"
+
+/// \brief The spectacles namespace.
+///
+/// Everything public facing is under this namespace.
+namespace spectacles {
+
+/// \brief The cache namespace.
+///
+/// Everything cache related is under this namespace.
+namespace cache {
+
+/// Guild#flags
+enum guild_flags {
+  GUILD_UNAVAILABLE = 1,
+  GUILD_LARGE = 2,
+};
+
+/// Channel#flags
+enum channel_flags {
+  CHANNEL_NSFW = 1,
+};
+
+/// Role#flags
+enum role_flags {
+  ROLE_HOIST = 1,
+  ROLE_MANAGED = 2,
+  ROLE_MENTIONABLE = 4,
+};
+
+/// Member#flags
+enum member_flags {
+  MEMBER_DEAF = 1,
+  MEMBER_MUTE = 2,
+  MEMBER_NICK = 4,
+  MEMBER_ROLES_TRUNCATED = 8,
+};
+
+/// \brief A cached guild.
+///
+/// Names longer than the record are truncated.
+struct Guild {
+  uint64_t owner_id;
+  uint32_t member_count;
+  uint8_t flags;
+  uint8_t name_length;
+  uint16_t reserved;
+  char name[48];
+};
+
+/// A cached guild channel.
+struct Channel {
+  uint64_t guild_id;
+  uint64_t parent_id;
+  int32_t position;
+  uint8_t type;
+  uint8_t flags;
+  uint8_t name_length;
+  uint8_t reserved;
+  char name[32];
+};
+
+/// A cached role.
+struct Role {
+  uint64_t guild_id;
+  uint64_t permissions;
+  uint32_t color;
+  int16_t position;
+  uint8_t flags;
+  uint8_t name_length;
+  char name[32];
+};
+
+/// \brief A cached guild member.
+///
+/// Only the first Member::ROLES roles are kept; MEMBER_ROLES_TRUNCATED is set when there were more.
+struct Member {
+  static const int ROLES = 5;
+
+  /// When the member joined, in seconds since the epoch.
+  uint32_t joined_at;
+  uint8_t flags;
+  uint8_t role_count;
+  uint16_t reserved;
+  uint64_t roles[ROLES];
+};
+
+/// \brief A slot of an open-addressing table, versioned with a seqlock.
+///
+/// The version is odd while the writer changes the slot, and readers retry when it changed under them.
+template <typename T>
+struct Slot {
+  enum {
+    EMPTY,
+    FULL,
+    DELETED,
+  };
+
+  std::atomic<uint32_t> version;
+  std::atomic<uint32_t> state;
+  std::atomic<uint64_t> id;
+  std::atomic<uint64_t> scope;
+  T record;
+};
+
+/// \brief Linear probing over slots owned by someone else, such as a heap allocation or a shared mapping.
+///
+/// Entries are keyed by an ID and a scope, which is 0 for everything but members. Lookups are lock-free and may run
+/// on any thread, while Slots#put, Slots#erase and Slots#compact must only be called by one writer at a time. Records
+/// are copied in and out whole, so they must be trivially copyable.
+template <typename T>
+class Slots {
+  static_assert(std::is_trivially_copyable<T>::value, "cached records must be trivially copyable");
+
+ private:
+  Slot<T> *slots = nullptr;
+  size_t mask = 0;
+  size_t filled = 0;
+  size_t live = 0;
+  std::atomic<uint32_t> *moves = nullptr;
+
+  static size_t hash(uint64_t id, uint64_t scope) {
+    uint64_t h = id ^ (scope * 0x9e3779b97f4a7c15ULL);
+    h = (h ^ (h >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    h = (h ^ (h >> 27)) * 0x94d049bb133111ebULL;
+    return static_cast<size_t>(h ^ (h >> 31));
+  }
+
+  // Copies a consistent snapshot of a slot, and the record as well if it holds the key.
+  static uint32_t read(const Slot<T> &slot, uint64_t id, uint64_t scope, T *out, bool *match) {
+    while (true) {
+      uint32_t version = slot.version.load(std::memory_order_acquire);
+      if (version & 1) {
+        continue;
+      }
+
+      uint32_t state = slot.state.load(std::memory_order_relaxed);
+      *match = state == Slot<T>::FULL && slot.id.load(std::memory_order_relaxed) == id
+          && slot.scope.load(std::memory_order_relaxed) == scope;
+      if (*match && out) {
+        memcpy(static_cast<void *>(out), &slot.record, sizeof(T));
+      }
+
+      std::atomic_thread_fence(std::memory_order_acquire);
+      if (slot.version.load(std::memory_order_relaxed) == version) {
+        return state;
+      }
+    }
+  }
+
+  static void write(Slot<T> *slot, uint32_t state, uint64_t id, uint64_t scope, const T *record) {
+    uint32_t version = slot->version.load(std::memory_order_relaxed);
+    slot->version.store(version + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+
+    slot->state.store(state, std::memory_order_relaxed);
+    slot->id.store(id, std::memory_order_relaxed);
+    slot->scope.store(scope, std::memory_order_relaxed);
+    if (record) {
+      memcpy(static_cast<void *>(&slot->record), record, sizeof(T));
+    }
+
+    slot->version.store(version + 2, std::memory_order_release);
+  }
+
+  bool find(uint64_t id, uint64_t scope, T *out) const {
+    size_t index = hash(id, scope);
+    for (size_t probe = 0; probe <= mask; probe++) {
+      bool match;
+      uint32_t state = read(slots[(index + probe) & mask], id, scope, out, &match);
+      if (match) {
+        return true;
+      }
+
+      if (state == Slot<T>::EMPTY) {
+        return false;
+      }
+    }
+
+    return false;
+  }
+
+ public:
+  Slots() { }
+
+  /// \brief Uses zeroed or previously used memory as a table.
+  ///
+  /// \param[in] memory   - The slots.
+  /// \param[in] capacity - The number of slots, which must be a power of two.
+  /// \param[in] scan     - Whether to count the slots already in use, which only a writer reusing memory needs.
+  /// \param[in] moves    - A counter shared by the writer and every reader of the memory, odd while Slots#compact
+  ///                       moves entries, so lookups that miss can tell they raced with it.
+  Slots(Slot<T> *memory, size_t capacity, bool scan = true, std::atomic<uint32_t> *moves_ = nullptr)
+      : slots(memory), mask(capacity - 1), moves(moves_) {
+    for (size_t i = 0; scan && i < capacity; i++) {
+      uint32_t state = slots[i].state.load(std::memory_order_relaxed);
+      if (state != Slot<T>::EMPTY) {
+        filled++;
+      }
+
+      if (state == Slot<T>::FULL) {
+        live++;
+      }
+    }
+  }
+
+  /// The number of slots.
+  size_t capacity() const {
+    return slots ? mask + 1 : 0;
+  }
+
+  /// The number of entries.
+  size_t size() const {
+    return live;
+  }
+
+  /// The number of slots that are not empty, including deleted ones, which still lengthen probes.
+  size_t used() const {
+    return filled;
+  }
+
+  /// The number of deleted slots, which Slots#compact empties again.
+  size_t deleted() const {
+    return filled - live;
+  }
+
+  /// \brief Looks an entry up.
+  ///
+  /// \param[in]  id    - The ID.
+  /// \param[in]  scope - The scope.
+  /// \param[out] out   - The record.
+  /// \returns false if there is no such entry.
+  bool get(uint64_t id, uint64_t scope, T *out) const {
+    if (!slots) {
+      return false;
+    }
+
+    if (!moves) {
+      return find(id, scope, out);
+    }
+
+    // A hit is always right, but a miss only counts if no entry was moved along the probe meanwhile.
+    while (true) {
+      uint32_t before = moves->load(std::memory_order_acquire);
+      if (find(id, scope, out)) {
+        return true;
+      }
+
+      std::atomic_thread_fence(std::memory_order_acquire);
+      if (!(before & 1) && moves->load(std::memory_order_relaxed) == before) {
+        return false;
+      }
+    }
+  }
+
+  /// \brief Inserts or replaces an entry.
+  ///
+  /// \param[in] id     - The ID.
+  /// \param[in] scope  - The scope.
+  /// \param[in] record - The record.
+  /// \returns false if the table is full.
+  bool put(uint64_t id, uint64_t scope, const T &record) {
+    if (!slots) {
+      return false;
+    }
+
+    size_t index = hash(id, scope);
+    Slot<T> *free = nullptr;
+    for (size_t probe = 0; probe <= mask; probe++) {
+      Slot<T> *slot = &slots[(index + probe) & mask];
+      uint32_t state = slot->state.load(std::memory_order_relaxed);
+
+      if (state == Slot<T>::FULL && slot->id.load(std::memory_order_relaxed) == id
+          && slot->scope.load(std::memory_order_relaxed) == scope) {
+        write(slot, Slot<T>::FULL, id, scope, &record);
+        return true;
+      }
+
+      if (state == Slot<T>::DELETED && !free) {
+        free = slot;
+      } else if (state == Slot<T>::EMPTY) {
+        if (!free) {
+          // Keep one empty slot, so probes for missing keys always end.
+          if (filled + 1 >= capacity()) {
+            return false;
+          }
+
+          free = slot;
+          filled++;
+        }
+        break;
+      }
+    }
+
+    if (!free) {
+      return false;
+    }
+
+    write(free, Slot<T>::FULL, id, scope, &record);
+    live++;
+    return true;
+  }
+
+  /// \brief Removes an entry.
+  ///
+  /// \param[in] id    - The ID.
+  /// \param[in] scope - The scope.
+  /// \returns false if there was no such entry.
+  bool erase(uint64_t id, uint64_t scope) {
+    if (!slots) {
+      return false;
+    }
+
+    size_t index = hash(id, scope);
+    for (size_t probe = 0; probe <= mask; probe++) {
+      Slot<T> *slot = &slots[(index + probe) & mask];
+      uint32_t state = slot->state.load(std::memory_order_relaxed);
+
+      if (state == Slot<T>::EMPTY) {
+        return false;
+      }
+
+      if (state == Slot<T>::FULL && slot->id.load(std::memory_order_relaxed) == id
+          && slot->scope.load(std::memory_order_relaxed) == scope) {
+        write(slot, Slot<T>::DELETED, id, scope, nullptr);
+        live--;
+        return true;
+      }
+    }
+
+    return false;
+  }
+
+  /// \brief Removes every entry matching a predicate.
+  ///
+  /// \param[in] predicate - Called with the ID, scope and record of every entry.
+  /// \returns The number of removed entries.
+  template <typename Predicate>
+  size_t eraseIf(Predicate predicate) {
+    size_t erased = 0;
+    for (size_t i = 0; i < capacity(); i++) {
+      Slot<T> *slot = &slots[i];
+      if (slot->state.load(std::memory_order_relaxed) != Slot<T>::FULL) {
+        continue;
+      }
+
+      uint64_t id = slot->id.load(std::memory_order_relaxed);
+      uint64_t scope = slot->scope.load(std::memory_order_relaxed);
+      if (predicate(id, scope, slot->record)) {
+        write(slot, Slot<T>::DELETED, id, scope, nullptr);
+        live--;
+        erased++;
+      }
+    }
+
+    return erased;
+  }
+
+  /// \brief Empties every deleted slot in place.
+  ///
+  /// Going around the table from an empty slot, each entry is moved back into the first deleted slot on its probe
+  /// chain, if any. Afterwards no entry's probe crosses a deleted slot, so they can all be emptied. Lookups racing
+  /// with this retry on a miss, as long as the slots were given a move counter.
+  ///
+  /// \returns The number of slots emptied.
+  size_t compact() {
+    if (!slots || filled == live) {
+      return 0;
+    }
+
+    if (moves) {
+      moves->fetch_add(1, std::memory_order_relaxed);
+      std::atomic_thread_fence(std::memory_order_release);
+    }
+
+    // There is always an empty slot, and starting after it no probe chain wraps around the start.
+    size_t start = 0;
+    while (slots[start].state.load(std::memory_order_relaxed) != Slot<T>::EMPTY) {
+      start++;
+    }
+
+    for (size_t n = 1; n <= mask; n++) {
+      size_t i = (start + n) & mask;
+      Slot<T> *slot = &slots[i];
+      if (slot->state.load(std::memory_order_relaxed) != Slot<T>::FULL) {
+        continue;
+      }
+
+      uint64_t id = slot->id.load(std::memory_order_relaxed);
+      uint64_t scope = slot->scope.load(std::memory_order_relaxed);
+      for (size_t j = hash(id, scope) & mask; j != i; j = (j + 1) & mask) {
+        if (slots[j].state.load(std::memory_order_relaxed) == Slot<T>::DELETED) {
+          // Copied before being deleted, so the entry is always in at least one place.
+          write(&slots[j], Slot<T>::FULL, id, scope, &slot->record);
+          write(slot, Slot<T>::DELETED, id, scope, nullptr);
+          break;
+        }
+      }
+    }
+
+    size_t emptied = 0;
+    for (size_t i = 0; i <= mask; i++) {
+      if (slots[i].state.load(std::memory_order_relaxed) == Slot<T>::DELETED) {
+        write(&slots[i], Slot<T>::EMPTY, 0, 0, nullptr);
+        emptied++;
+      }
+    }
+
+    filled -= emptied;
+
+    if (moves) {
+      moves->fetch_add(1, std::memory_order_release);
+    }
+
+    return emptied;
+  }
+
+  /// \brief Calls a function with every entry.
+  ///
+  /// \param[in] fn - Called with the ID, scope and record of every entry.
+  template <typename Fn>
+  void each(Fn fn) const {
+    for (size_t i = 0; i < capacity(); i++) {
+      const Slot<T> &slot = slots[i];
+      if (slot.state.load(std::memory_order_relaxed) != Slot<T>::FULL) {
+        continue;
+      }
+
+      T record;
+      bool match;
+      uint64_t id = slot.id.load(std::memory_order_relaxed);
+      uint64_t scope = slot.scope.load(std::memory_order_relaxed);
+      if (read(slot, id, scope, &record, &match) == Slot<T>::FULL && match) {
+        fn(id, scope, record);
+      }
+    }
+  }
+};
+
+/// \brief A table on the heap, which grows as needed.
+///
+/// Once three quarters of the slots are used, deleted slots are emptied in place if that leaves at least half of the
+/// table free; otherwise the entries are copied into a fresh table twice the size, which is then swapped in. Readers
+/// may still be probing the old table, so retired tables are only freed along with this one, but as every one is at
+/// most half the size of the next they never add up to more than the current one. Writers are serialized by a mutex.
+template <typename T>
+class Table {
+ private:
+  struct Generation {
+    std::unique_ptr<Slot<T>[]> memory;
+    std::atomic<uint32_t> moves{0};
+    Slots<T> slots;
+  };
+
+  std::vector<std::unique_ptr<Generation>> generations;
+  std::atomic<Slots<T> *> current{nullptr};
+  std::mutex mutex;
+
+  Slots<T> *grow(size_t capacity) {
+    std::unique_ptr<Generation> next(new Generation());
+    next->memory.reset(new Slot<T>[capacity]());
+    next->slots = Slots<T>(next->memory.get(), capacity, true, &next->moves);
+
+    Slots<T> *previous = current.load(std::memory_order_relaxed);
+    if (previous) {
+      Slots<T> &into = next->slots;
+      previous->each([&into](uint64_t id, uint64_t scope, const T &record) {
+        into.put(id, scope, record);
+      });
+    }
+
+    current.store(&next->slots, std::memory_order_release);
+    generations.push_back(std::move(next));
+    return current.load(std::memory_order_relaxed);
+  }
+
+ public:
+  /// \brief Creates an empty table.
+  ///
+  /// \param[in] capacity - The initial number of slots, which must be a power of two.
+  explicit Table(size_t capacity = 1024) {
+    grow(capacity);
+  }
+
+  Table(const Table &) = delete;
+  Table &operator=(const Table &) = delete;
+
+  /// Looks an entry up. Safe to call from any thread.
+  bool get(uint64_t id, uint64_t scope, T *out) const {
+    return current.load(std::memory_order_acquire)->get(id, scope, out);
+  }
+
+  /// Inserts or replaces an entry.
+  bool put(uint64_t id, uint64_t scope, const T &record) {
+    std::lock_guard<std::mutex> lock(mutex);
+
+    Slots<T> *slots = current.load(std::memory_order_relaxed);
+    if ((slots->used() + 1) * 4 > slots->capacity() * 3) {
+      size_t capacity = slots->capacity();
+      while ((slots->size() + 1) * 2 > capacity) {
+        capacity *= 2;
+      }
+
+      // Rebuilding at the same size would retire a whole table just to drop deleted slots.
+      if (capacity == slots->capacity()) {
+        slots->compact();
+      } else {
+        slots = grow(capacity);
+      }
+    }
+
+    return slots->put(id, scope, record);
+  }
+
+  /// Removes an entry.
+  bool erase(uint64_t id, uint64_t scope) {
+    std::lock_guard<std::mutex> lock(mutex);
+    return current.load(std::memory_order_relaxed)->erase(id, scope);
+  }
+
+  /// Removes every entry matching a predicate.
+  template <typename Predicate>
+  size_t eraseIf(Predicate predicate) {
+    std::lock_guard<std::mutex> lock(mutex);
+    return current.load(std::memory_order_relaxed)->eraseIf(predicate);
+  }
+
+  /// The number of entries.
+  size_t size() const {
+    return current.load(std::memory_order_acquire)->size();
+  }
+};
+
+/// \brief Guild state kept up to date from gateway dispatches.
+///
+/// Dispatches are read straight from their etf encoding with an etf::Scanner and stored as compact fixed-size
+/// records, so nothing is decoded into etf::Data. Implementations decide where the records live.
+///
+/// \note Connections on different threads may share a store, as every guild's dispatches come from a single shard.
+/// The getters may be called from any thread.
+class Store {
+ private:
+  void readGuild(etf::Scanner *s, bool create);
+  void guildDelete(etf::Scanner *s);
+  void readChannel(etf::Scanner *s, uint64_t guildId);
+  void channelDelete(etf::Scanner *s);
+  void readRole(etf::Scanner *s, uint64_t guildId);
+  void roleEvent(etf::Scanner *s, bool remove);
+  void readMember(etf::Scanner *s, uint64_t guildId, bool add);
+  void memberRemove(etf::Scanner *s);
+  void membersChunk(etf::Scanner *s);
+
+ protected:
+  virtual bool putGuild(uint64_t id, const Guild &guild) = 0;
+  virtual bool putChannel(uint64_t id, const Channel &channel) = 0;
+  virtual bool putRole(uint64_t id, const Role &role) = 0;
+  virtual bool putMember(uint64_t guild, uint64_t user, const Member &member) = 0;
+  virtual bool eraseGuild(uint64_t id) = 0;
+  virtual bool eraseChannel(uint64_t id) = 0;
+  virtual bool eraseRole(uint64_t id) = 0;
+  virtual bool eraseMember(uint64_t guild, uint64_t user) = 0;
+
+  /// Removes every channel, role and member of a guild.
+  virtual void purge(uint64_t guild) = 0;
+
+ public:
+  virtual ~Store() { }
+
+  /// \brief Updates the cache from a dispatch.
+  ///
+  /// Handles GUILD_CREATE, GUILD_UPDATE, GUILD_DELETE, CHANNEL_CREATE, CHANNEL_UPDATE, CHANNEL_DELETE, GUILD_ROLE_CREATE,
+  /// GUILD_ROLE_UPDATE, GUILD_ROLE_DELETE, GUILD_MEMBER_ADD, GUILD_MEMBER_UPDATE, GUILD_MEMBER_REMOVE and
+  /// GUILD_MEMBERS_CHUNK; other events are ignored.
+  ///
+  /// \param[in] t - The event name.
+  /// \param[in] d - The encoded event data, without a version byte.
+  /// \returns false if the event was not handled.
+  bool apply(const etf::Slice &t, const etf::Slice &d);
+
+  /// Looks a guild up.
+  virtual bool guild(uint64_t id, Guild *out) const = 0;
+
+  /// Looks a channel up.
+  virtual bool channel(uint64_t id, Channel *out) const = 0;
+
+  /// Looks a role up.
+  virtual bool role(uint64_t id, Role *out) const = 0;
+
+  /// Looks a member up.
+  virtual bool member(uint64_t guild, uint64_t user, Member *out) const = 0;
+};
+
+/// A Store kept in this process's memory.
+class MemoryStore : public Store {
+ private:
+  Table<Guild> guilds;
+  Table<Channel> channels;
+  Table<Role> roles;
+  Table<Member> members;
+
+ protected:
+  bool putGuild(uint64_t id, const Guild &guild);
+  bool putChannel(uint64_t id, const Channel &channel);
+  bool putRole(uint64_t id, const Role &role);
+  bool putMember(uint64_t guild, uint64_t user, const Member &member);
+  bool eraseGuild(uint64_t id);
+  bool eraseChannel(uint64_t id);
+  bool eraseRole(uint64_t id);
+  bool eraseMember(uint64_t guild, uint64_t user);
+  void purge(uint64_t guild);
+
+ public:
+  MemoryStore() { }
+
+  MemoryStore(const MemoryStore &) = delete;
+  MemoryStore &operator=(const MemoryStore &) = delete;
+
+  bool guild(uint64_t id, Guild *out) const;
+  bool channel(uint64_t id, Channel *out) const;
+  bool role(uint64_t id, Role *out) const;
+  bool member(uint64_t guild, uint64_t user, Member *out) const;
+};
+
+/// \brief A Store in a memory-mapped file, which other processes on the host can read without copying it.
+///
+/// One process creates the store and writes to it, usually by handing it to its Connections as Options#cache.
+/// Any number of processes attach to the same file read-only, such as one under /dev/shm, and look entries up
+/// straight from the shared pages; the per-slot seqlocks make those lookups wait-free for readers as long as the
+/// writer is not changing the same slot. Tables do not grow, so the capacities must be chosen up front. A table
+/// takes new entries only while at most three quarters of its slots are in use, as probes for missing keys run
+/// through most of a fuller one; entries that do not fit are counted by SharedStore#dropped.
+///
+/// Removed entries leave deleted slots behind, which lengthen every probe that crosses them, misses included, and
+/// count against the three quarters. Once they make up an eighth of a table the writer compacts it in place on its
+/// next insert, which walks the whole table; lookups that miss while it runs retry until it's done. Capacities of
+/// about twice the expected entry count keep probes short between compactions.
+///
+/// \note Reader and writer must be built with the same record layout, which attaching checks.
+class SharedStore : public Store {
+ public:
+  /// The number of slots per table. Each must be a power of two, and a table holds up to three quarters as many
+  /// entries.
+  struct Capacity {
+    size_t guilds;
+    size_t channels;
+    size_t roles;
+    size_t members;
+
+    Capacity() : guilds(1 << 14), channels(1 << 18), roles(1 << 18), members(1 << 20) { }
+  };
+
+ private:
+  struct Header;
+
+  std::string path;
+  int fd = -1;
+  size_t size = 0;
+  void *memory = nullptr;
+  bool writable = false;
+  ino_t inode = 0;
+  Slots<Guild> guilds;
+  Slots<Channel> channels;
+  Slots<Role> roles;
+  Slots<Member> members;
+  std::mutex guildMutex;
+  std::mutex channelMutex;
+  std::mutex roleMutex;
+  std::mutex memberMutex;
+
+  static size_t layout(const Capacity &capacity, size_t offsets[4]);
+
+  void place(const Capacity &capacity);
+  void drop();
+
+ protected:
+  bool putGuild(uint64_t id, const Guild &guild);
+  bool putChannel(uint64_t id, const Channel &channel);
+  bool putRole(uint64_t id, const Role &role);
+  bool putMember(uint64_t guild, uint64_t user, const Member &member);
+  bool eraseGuild(uint64_t id);
+  bool eraseChannel(uint64_t id);
+  bool eraseRole(uint64_t id);
+  bool eraseMember(uint64_t guild, uint64_t user);
+  void purge(uint64_t guild);
+
+ public:
+  /// Creates a store that is not backed by anything yet.
+  SharedStore() { }
+
+  SharedStore(const SharedStore &) = delete;
+  SharedStore &operator=(const SharedStore &) = delete;
+
+  /// Unmaps and closes the file, leaving it in place for readers.
+  ~SharedStore();
+
+  /// \brief Creates the store as its writer.
+  ///
+  /// An existing file is replaced rather than truncated, so readers still attached to it keep a consistent, if
+  /// stale, view until they notice with SharedStore#current and attach again.
+  ///
+  /// \param[in] path     - The file to create.
+  /// \param[in] capacity - The size of each table.
+  /// \returns false if the file could not be created or mapped.
+  bool create(const std::string &path, const Capacity &capacity = Capacity());
+
+  /// \brief Attaches to a store created by another process, read-only.
+  ///
+  /// \param[in] path - The file the writer created.
+  /// \returns false if the file could not be mapped or was written with a different record layout.
+  bool attach(const std::string &path);
+
+  /// \brief Checks whether the attached file is still the one at its path.
+  ///
+  /// \returns false once a writer has replaced it, after which the store should be attached again.
+  bool current() const;
+
+  /// The number of entries that did not fit in their table.
+  uint64_t dropped() const;
+
+  bool guild(uint64_t id, Guild *out) const;
+  bool channel(uint64_t id, Channel *out) const;
+  bool role(uint64_t id, Role *out) const;
+  bool member(uint64_t guild, uint64_t user, Member *out) const;
+};
+
+}  // namespace cache
+
+}  // namespace spectacles
+
+#endif  // SPECTACLES_INCLUDE_CACHE_H_
@@ -0,0 +1,95 @@
+#ifndef SPECTACLES_INCLUDE_COALESCER_H_
+#define SPECTACLES_INCLUDE_COALESCER_H_
+
+#include <atomic>
+#include <chrono>
+#include <cinttypes>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <thread>
+#include <utility>
+
+#include "gateway.h"
+#include "metrics.h"
+
+/// \brief The spectacles namespace.
+///
+/// Everything public facing is under this namespace.
+namespace spectacles {
+
+/// \brief Holds back presence updates so only the latest one per guild member is passed on.
+///
+/// Meant to sit between Connection#onMessage and Publisher#publish. The first PRESENCE_UPDATE for a member starts a
+/// window; updates for the same member within it replace the held one, and when the window closes the latest update
+/// is passed on. Every other packet is passed on straight away.
+///
+/// \note The coalescer spawns it's own thread, but never calls the handler from two threads at once, so a handler
+/// that publishes through a single Publisher is safe.
+class PresenceCoalescer {
+ private:
+  typedef std::pair<uint64_t, uint64_t> Key;
+  typedef std::chrono::steady_clock Clock;
+
+  std::chrono::milliseconds window;
+  std::function<void(gateway::Packet)> messageHandler;
+  std::map<Key, gateway::Packet> held;
+  std::deque<std::pair<Clock::time_point, Key>> deadlines;
+  std::mutex mutex;
+  std::mutex handlerMutex;
+  std::condition_variable wake;
+  bool stopping = false;
+  std::thread thread;
+
+  std::atomic<uint64_t> receivedCount{0};
+  std::atomic<uint64_t> suppressedCount{0};
+  std::atomic<uint64_t> publishedCount{0};
+  metrics::Counter *receivedMetric = nullptr;
+  metrics::Counter *suppressedMetric = nullptr;
+  metrics::Counter *publishedMetric = nullptr;
+
+  void emit(gateway::Packet packet);
+  void run();
+
+ public:
+  /// \brief Starts the flushing thread.
+  ///
+  /// \param[in] window - How long to hold a member's presence, in milliseconds.
+  explicit PresenceCoalescer(int window = 250);
+
+  PresenceCoalescer(const PresenceCoalescer &) = delete;
+  PresenceCoalescer &operator=(const PresenceCoalescer &) = delete;
+
+  /// Passes on every held update, then stops the flushing thread.
+  ~PresenceCoalescer();
+
+  /// \brief Called with every packet that is passed on.
+  ///
+  /// \param[in] handler - The event handler.
+  void onMessage(std::function<void(gateway::Packet)> handler);
+
+  /// \brief Takes a packet.
+  ///
+  /// \param[in] packet - The packet, such as one from Connection#onMessage.
+  void push(gateway::Packet packet);
+
+  /// \brief Reports received, suppressed and published presence updates to a registry.
+  ///
+  /// \param[in] registry - The registry to report to, or nullptr to stop reporting.
+  void useMetrics(metrics::Registry *registry);
+
+  /// The number of presence updates taken.
+  uint64_t received() const;
+
+  /// The number of presence updates dropped because a newer one replaced them.
+  uint64_t suppressed() const;
+
+  /// The number of presence updates passed on.
+  uint64_t published() const;
+};
+
+}  // namespace spectacles
+
+#endif  // SPECTACLES_INCLUDE_COALESCER_H_
@@ -0,0 +1,79 @@
+#ifndef SPECTACLES_INCLUDE_DISPATCH_H_
+#define SPECTACLES_INCLUDE_DISPATCH_H_
+
+#include <atomic>
+#include <cinttypes>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/// \brief The spectacles namespace.
+///
+/// Everything public facing is under this namespace.
+namespace spectacles {
+
+/// \brief A work-stealing thread pool which preserves ordering per key.
+///
+/// Tasks are submitted with a key, and tasks sharing a key run one at a time in the order they were submitted.
+/// Keys are hashed onto a fixed set of strands; a strand with pending tasks sits in the queue of exactly one worker,
+/// and idle workers steal strands from the back of busy workers' queues. Tasks with different keys may share a
+/// strand, which keeps them ordered relative to each other but never breaks ordering within a key.
+class DispatchPool {
+ private:
+  struct Strand {
+    std::mutex mutex;
+    std::deque<std::function<void()>> tasks;
+    bool scheduled = false;
+  };
+
+  struct Worker {
+    std::mutex mutex;
+    std::deque<size_t> strands;
+    std::thread thread;
+  };
+
+  std::vector<std::unique_ptr<Strand>> strands;
+  std::vector<std::unique_ptr<Worker>> workers;
+  std::atomic<size_t> nextWorker{0};
+  std::atomic<size_t> queued{0};
+  std::atomic<size_t> runnable{0};
+  std::atomic<bool> stopping{false};
+  std::mutex idleMutex;
+  std::condition_variable idle;
+
+  void schedule(size_t strand);
+  bool take(size_t worker, size_t *strand);
+  void run(size_t worker);
+
+ public:
+  /// \brief Starts the worker threads.
+  ///
+  /// \param[in] threads - The number of workers, or 0 for one per core.
+  /// \param[in] strands - The number of strands keys are hashed onto.
+  explicit DispatchPool(size_t threads = 0, size_t strands = 1024);
+
+  DispatchPool(const DispatchPool &) = delete;
+  DispatchPool &operator=(const DispatchPool &) = delete;
+
+  /// Runs every task already submitted, then stops the worker threads.
+  ~DispatchPool();
+
+  /// \brief Submits a task.
+  ///
+  /// This may be called from any thread, including from inside a task.
+  ///
+  /// \param[in] key  - Tasks with the same key run in submission order, never concurrently.
+  /// \param[in] task - The task to run.
+  void submit(uint64_t key, std::function<void()> task);
+
+  /// The number of tasks submitted but not yet started.
+  size_t pending() const;
+};
+
+}  // namespace spectacles
+
+#endif  // SPECTACLES_INCLUDE_DISPATCH_H_
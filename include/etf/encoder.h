@@ -100,10 +100,15 @@ namespace spectacles {
         }
       }
 
+      // Hands the buffer over to the caller, who has to free it.
       out_buf release() {
         out_buf buf;
         buf.buf = pk.buf;
         buf.length = pk.length;
+
+        pk.buf = NULL;
+        pk.length = 0;
+        pk.allocated_size = 0;
         return buf;
       }
 
@@ -4,5 +4,6 @@
 #include "data.h"
 #include "encoder.h"
 #include "decoder.h"
+#include "scanner.h"
 
 #endif  // SPECTACLES_INCLUDE_ETF_ETF_H_
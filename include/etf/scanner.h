@@ -0,0 +1,525 @@
+#ifndef SPECTACLES_INCLUDE_ETF_SCANNER_H_
+#define SPECTACLES_INCLUDE_ETF_SCANNER_H_
+
+#include <cinttypes>
+#include <cstdlib>
+#include <cstring>
+
+#include <string>
+
+#include "constants.h"
+
+namespace spectacles {
+
+namespace etf {
+
+/// A byte range inside of a buffer, which is not owned.
+struct Slice {
+  /// The first byte.
+  const char *data = nullptr;
+
+  /// The number of bytes.
+  size_t length = 0;
+
+  Slice() { }
+  Slice(const char *data_, size_t length_) : data(data_), length(length_) { }
+
+  /// Whether the slice points at anything.
+  bool empty() const {
+    return length == 0;
+  }
+
+  /// Compares the slice with a string, like std::string::compare.
+  int compare(const char *str, size_t size) const {
+    int c = memcmp(data, str, length < size ? length : size);
+    if (c != 0) {
+      return c;
+    }
+
+    return length < size ? -1 : (length > size ? 1 : 0);
+  }
+
+  /// Compares the slice with a string, like std::string::compare.
+  int compare(const std::string &str) const {
+    return compare(str.data(), str.size());
+  }
+
+  /// Checks whether the slice holds exactly the given string.
+  bool equals(const char *str) const {
+    return compare(str, strlen(str)) == 0;
+  }
+
+  /// Copies the slice into a string.
+  std::string str() const {
+    return std::string(data, length);
+  }
+};
+
+/// The top level fields of a gateway payload.
+struct Header {
+  /// The payload opcode, or -1 if not present.
+  int op = -1;
+
+  /// The sequence number, or -1 if not present.
+  int s = -1;
+
+  /// The event name, empty if not present.
+  Slice t;
+
+  /// The encoded event data, without a version byte.
+  Slice d;
+};
+
+/// \brief Walks etf encoded data without decoding it.
+///
+/// Unlike the Decoder, the scanner never allocates: it only reads headers and scalars and reports byte ranges,
+/// which makes it cheap enough to run on every frame before deciding whether a full decode is needed. Every method
+/// returns false once the data turns out to be malformed or to use a term the scanner does not understand.
+class Scanner {
+ private:
+  const uint8_t *data;
+  size_t size;
+  size_t offset = 0;
+  bool invalid = false;
+
+  bool has(size_t n) {
+    if (invalid || offset + n > size) {
+      invalid = true;
+      return false;
+    }
+
+    return true;
+  }
+
+  uint32_t read(size_t n) {
+    uint32_t value = 0;
+    for (size_t i = 0; i < n; i++) {
+      value = (value << 8) | data[offset + i];
+    }
+
+    offset += n;
+    return value;
+  }
+
+ public:
+  /// \brief Creates a scanner.
+  ///
+  /// \param[in] data        - The etf data.
+  /// \param[in] length      - The size of data.
+  /// \param[in] skipVersion - Whether data starts directly with a term instead of a version byte.
+  Scanner(const char *data_, size_t length_, bool skipVersion = false) : data(reinterpret_cast<const uint8_t *>(data_)), size(length_) {
+    if (!skipVersion) {
+      if (has(1) && read(1) != FORMAT_VERSION) {
+        invalid = true;
+      }
+    }
+  }
+
+  /// Whether everything read so far was valid.
+  bool good() const {
+    return !invalid;
+  }
+
+  /// The current position.
+  size_t tell() const {
+    return offset;
+  }
+
+  /// Moves to a position previously returned by Scanner#tell.
+  void seek(size_t position) {
+    offset = position;
+  }
+
+  /// The type of the term at the current position, or 0 at the end.
+  uint8_t peek() const {
+    return (invalid || offset >= size) ? 0 : data[offset];
+  }
+
+  /// Skips over the term at the current position, including everything nested in it.
+  bool skip() {
+    size_t pending = 1;
+
+    while (pending > 0) {
+      pending--;
+
+      if (!has(1)) {
+        return false;
+      }
+
+      size_t n = 0;
+      switch (read(1)) {
+        case SMALL_INTEGER_EXT:
+          n = 1;
+          break;
+        case INTEGER_EXT:
+          n = 4;
+          break;
+        case FLOAT_EXT:
+          n = 31;
+          break;
+        case NEW_FLOAT_EXT:
+          n = 8;
+          break;
+        case NIL_EXT:
+          break;
+        case ATOM_EXT:
+        case STRING_EXT:
+          if (!has(2)) {
+            return false;
+          }
+          n = read(2);
+          break;
+        case SMALL_ATOM_EXT:
+          if (!has(1)) {
+            return false;
+          }
+          n = read(1);
+          break;
+        case BINARY_EXT:
+          if (!has(4)) {
+            return false;
+          }
+          n = read(4);
+          break;
+        case SMALL_BIG_EXT:
+          if (!has(1)) {
+            return false;
+          }
+          n = read(1) + 1;
+          break;
+        case LARGE_BIG_EXT:
+          if (!has(4)) {
+            return false;
+          }
+          n = read(4) + 1;
+          break;
+        case SMALL_TUPLE_EXT:
+          if (!has(1)) {
+            return false;
+          }
+          pending += read(1);
+          break;
+        case LARGE_TUPLE_EXT:
+          if (!has(4)) {
+            return false;
+          }
+          pending += read(4);
+          break;
+        case LIST_EXT:
+          if (!has(4)) {
+            return false;
+          }
+          pending += static_cast<size_t>(read(4)) + 1;
+          break;
+        case MAP_EXT:
+          if (!has(4)) {
+            return false;
+          }
+          pending += static_cast<size_t>(read(4)) * 2;
+          break;
+        case COMPRESSED:
+          // The compressed stream has no length of its own and always runs to the end of the buffer.
+          if (!has(4)) {
+            return false;
+          }
+          n = size - offset - 4;
+          offset += 4;
+          break;
+        default:
+          invalid = true;
+          return false;
+      }
+
+      if (!has(n)) {
+        return false;
+      }
+      offset += n;
+    }
+
+    return true;
+  }
+
+  /// \brief Records the byte range of the term at the current position and skips over it.
+  ///
+  /// \param[out] out - The range of the term.
+  bool term(Slice *out) {
+    size_t start = offset;
+    if (!skip()) {
+      return false;
+    }
+
+    *out = Slice(reinterpret_cast<const char *>(data + start), offset - start);
+    return true;
+  }
+
+  /// \brief Reads a map header.
+  ///
+  /// \param[out] arity - The number of key/value pairs that follow.
+  bool mapHeader(uint32_t *arity) {
+    if (!has(5) || data[offset] != MAP_EXT) {
+      invalid = true;
+      return false;
+    }
+
+    offset++;
+    *arity = read(4);
+    return true;
+  }
+
+  /// \brief Reads a list header.
+  ///
+  /// An empty list reads as a length of 0. A non-empty list is followed by its elements and a tail term.
+  ///
+  /// \param[out] length - The number of elements that follow.
+  bool listHeader(uint32_t *length) {
+    if (peek() == NIL_EXT) {
+      offset++;
+      *length = 0;
+      return true;
+    }
+
+    if (!has(5) || data[offset] != LIST_EXT) {
+      invalid = true;
+      return false;
+    }
+
+    offset++;
+    *length = read(4);
+    return true;
+  }
+
+  /// Checks whether the term at the current position is nil, skipping it if so.
+  bool nil() {
+    Slice atom;
+    size_t start = offset;
+    uint8_t type = peek();
+    if ((type == SMALL_ATOM_EXT || type == ATOM_EXT) && string(&atom) && (atom.equals("nil") || atom.equals("null"))) {
+      return true;
+    }
+
+    offset = start;
+    return false;
+  }
+
+  /// \brief Reads an atom, binary or string.
+  ///
+  /// \param[out] out - The characters, pointing into the scanned buffer.
+  bool string(Slice *out) {
+    if (!has(1)) {
+      return false;
+    }
+
+    size_t n;
+    switch (data[offset]) {
+      case SMALL_ATOM_EXT:
+        if (!has(2)) {
+          return false;
+        }
+        offset++;
+        n = read(1);
+        break;
+      case ATOM_EXT:
+      case STRING_EXT:
+        if (!has(3)) {
+          return false;
+        }
+        offset++;
+        n = read(2);
+        break;
+      case BINARY_EXT:
+        if (!has(5)) {
+          return false;
+        }
+        offset++;
+        n = read(4);
+        break;
+      default:
+        invalid = true;
+        return false;
+    }
+
+    if (!has(n)) {
+      return false;
+    }
+
+    *out = Slice(reinterpret_cast<const char *>(data + offset), n);
+    offset += n;
+    return true;
+  }
+
+  /// \brief Reads an integer of up to 64 bits.
+  ///
+  /// \param[out] out - The value.
+  bool integer(int64_t *out) {
+    if (!has(1)) {
+      return false;
+    }
+
+    switch (data[offset]) {
+      case SMALL_INTEGER_EXT:
+        if (!has(2)) {
+          return false;
+        }
+        offset++;
+        *out = read(1);
+        return true;
+      case INTEGER_EXT:
+        if (!has(5)) {
+          return false;
+        }
+        offset++;
+        *out = static_cast<int32_t>(read(4));
+        return true;
+      case SMALL_BIG_EXT: {
+        if (!has(3)) {
+          return false;
+        }
+        offset++;
+        size_t digits = read(1);
+        uint8_t sign = read(1);
+        if (digits > 8 || !has(digits)) {
+          invalid = true;
+          return false;
+        }
+
+        uint64_t value = 0;
+        for (size_t i = 0; i < digits; i++) {
+          value |= static_cast<uint64_t>(data[offset + i]) << (8 * i);
+        }
+        offset += digits;
+
+        *out = sign ? -static_cast<int64_t>(value) : static_cast<int64_t>(value);
+        return true;
+      }
+      default:
+        invalid = true;
+        return false;
+    }
+  }
+
+  /// \brief Reads a snowflake, which may be encoded as an integer or as a decimal string.
+  ///
+  /// \param[out] out - The snowflake.
+  bool snowflake(uint64_t *out) {
+    uint8_t type = peek();
+    if (type == BINARY_EXT || type == STRING_EXT) {
+      Slice digits;
+      if (!string(&digits) || digits.length == 0 || digits.length > 20) {
+        invalid = true;
+        return false;
+      }
+
+      uint64_t value = 0;
+      for (size_t i = 0; i < digits.length; i++) {
+        if (digits.data[i] < '0' || digits.data[i] > '9') {
+          invalid = true;
+          return false;
+        }
+        value = value * 10 + (digits.data[i] - '0');
+      }
+
+      *out = value;
+      return true;
+    }
+
+    int64_t value;
+    if (!integer(&value)) {
+      return false;
+    }
+
+    *out = static_cast<uint64_t>(value);
+    return true;
+  }
+
+  /// \brief Moves to the value of a key in the map at the current position.
+  ///
+  /// On failure the position is left where it was.
+  ///
+  /// \param[in] key - The key to look for.
+  /// \returns false if the key is missing or the term is not a map.
+  bool find(const char *key) {
+    size_t start = offset;
+    size_t keyLength = strlen(key);
+
+    uint32_t arity;
+    if (mapHeader(&arity)) {
+      for (uint32_t i = 0; i < arity; i++) {
+        uint8_t type = peek();
+        Slice k;
+        if (type == SMALL_ATOM_EXT || type == ATOM_EXT || type == BINARY_EXT || type == STRING_EXT) {
+          if (!string(&k)) {
+            break;
+          }
+
+          if (k.compare(key, keyLength) == 0) {
+            return true;
+          }
+        } else if (!skip()) {
+          break;
+        }
+
+        if (!skip()) {
+          break;
+        }
+      }
+    }
+
+    offset = start;
+    invalid = false;
+    return false;
+  }
+
+  /// \brief Reads the top level fields of a gateway payload.
+  ///
+  /// Only the header is interpreted; the event data is located but not read.
+  ///
+  /// \param[out] header - The fields that were found.
+  bool header(Header *header) {
+    uint32_t arity;
+    if (!mapHeader(&arity)) {
+      return false;
+    }
+
+    for (uint32_t i = 0; i < arity; i++) {
+      Slice key;
+      if (!string(&key)) {
+        return false;
+      }
+
+      int64_t value;
+      if (key.equals("op")) {
+        if (!integer(&value)) {
+          return false;
+        }
+        header->op = static_cast<int>(value);
+      } else if (key.equals("s")) {
+        if (nil()) {
+          continue;
+        } else if (!integer(&value)) {
+          return false;
+        }
+        header->s = static_cast<int>(value);
+      } else if (key.equals("t")) {
+        if (nil()) {
+          continue;
+        } else if (!string(&header->t)) {
+          return false;
+        }
+      } else if (key.equals("d")) {
+        if (!term(&header->d)) {
+          return false;
+        }
+      } else if (!skip()) {
+        return false;
+      }
+    }
+
+    return true;
+  }
+};
+
+}  // namespace etf
+
+}  // namespace spectacles
+
+#endif  // SPECTACLES_INCLUDE_ETF_SCANNER_H_
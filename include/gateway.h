@@ -3,7 +3,24 @@
 
 #include <uWS/uWS.h>
 
+#include <atomic>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "buffer.h"
+#include "cache.h"
+#include "dispatch.h"
 #include "etf/etf.h"
+#include "histogram.h"
+#include "metrics.h"
+#include "queue.h"
+#include "ratelimit.h"
+#include "session.h"
 
 /// \brief The spectacles namespace.
 ///
@@ -15,11 +32,25 @@ namespace spectacles {
 /// Everything gateway related is under this namespace.
 namespace gateway {
 
+class Recorder;
+
+/// How dispatches handed to a DispatchPool are ordered.
+enum order_type {
+  /// Every dispatch of a shard is handled in order.
+  ORDER_BY_SHARD,
+
+  /// Dispatches are handled in order per guild, falling back to the shard for dispatches without a guild_id.
+  ORDER_BY_GUILD,
+};
+
 /// %Options used when connecting to the Discord gateway.
 struct Options {
   /// The token used to authenticate with the Discord gateway.
   std::string token;
 
+  /// The gateway to connect to, which may be pointed at a local mock gateway for testing.
+  std::string url = "wss://gateway.discord.gg/?v=6&encoding=etf";
+
   /// [Presence](https://discordapp.com/developers/docs/topics/gateway#update-status) structure for initial presence information.
   etf::Data presence = nullptr;
 
@@ -31,6 +62,62 @@ struct Options {
 
   /// Value between 50 and 250, total number of members where the gateway will stop sending offline members in the guild member list.
   int large_threshold = 250;
+
+  /// The number of commands that may be sent per Options#rate_limit_interval. Part of it is reserved for heartbeats.
+  int rate_limit = 120;
+
+  /// The length of the rate limit window in milliseconds.
+  int rate_limit_interval = 60000;
+
+  /// \brief The dispatch events to process. If left as an empty set, every event is processed.
+  ///
+  /// Filtered dispatches are dropped straight from the raw frame, before they are decoded or handed to a message handler.
+  /// Their sequence number is still tracked, and READY and RESUMED are never filtered.
+  std::set<std::string> events;
+
+  /// The dispatch events to drop, checked after Options#events.
+  std::set<std::string> ignored_events;
+
+  /// \brief Where to persist the session, or nullptr to keep it in memory only.
+  ///
+  /// When a stored session for this shard is recent enough, connecting resumes it instead of identifying.
+  SessionStore *session_store = nullptr;
+
+  /// How long a stored session stays resumable after its last update, in milliseconds.
+  int resume_window = 60000;
+
+  /// The registry to report message, byte, decode time, reconnect and queue metrics to, or nullptr to not collect any.
+  metrics::Registry *metrics = nullptr;
+
+  /// \brief The pool to decode and handle dispatches on, or nullptr to handle them on the connection's thread.
+  ///
+  /// With a pool, the connection's thread only reads frames, tracks the sequence and session, and handles the
+  /// other opcodes; dispatches are copied and handed to the pool, ordered according to Options#dispatch_order.
+  /// Handlers may then run on any of the pool's threads, and the Connection must outlive every submitted dispatch.
+  DispatchPool *dispatch_pool = nullptr;
+
+  /// How dispatches handed to Options#dispatch_pool are ordered.
+  order_type dispatch_order = ORDER_BY_SHARD;
+
+  /// \brief Whether to put dispatches behind control opcodes when there is no Options#dispatch_pool.
+  ///
+  /// Opcodes are read from the raw frame header. Heartbeats, ACKs, reconnects and invalid sessions are handled
+  /// as soon as they are read, while dispatches are only bookkept and then queued. The queue is drained
+  /// Options#dispatch_batch at a time, returning to the event loop between batches, so a flood of dispatches
+  /// cannot delay a heartbeat ACK long enough to look like a zombie connection.
+  bool defer_dispatches = false;
+
+  /// The number of deferred dispatches handled per event loop iteration, at least 1.
+  int dispatch_batch = 32;
+
+  /// Where to record every inbound frame for later replay, or nullptr to not record.
+  Recorder *recorder = nullptr;
+
+  /// \brief The cache to keep up to date with guild, channel, role and member dispatches, or nullptr to not cache.
+  ///
+  /// The cache is updated from the raw frame on the connection's thread, before the dispatch is filtered or handed
+  /// to a handler, so it sees every event even when Options#events leaves them out.
+  cache::Store *cache = nullptr;
 };
 
 /// A packet coming from a Connection or a brokers::Consumer.
@@ -53,10 +140,16 @@ class Packet {
   etf::Data d;
 
   /// The raw etf data.
-  char *raw;
+  char *raw = nullptr;
 
   /// The size of Packet#raw
-  size_t length;
+  size_t length = 0;
+
+  /// When the payload was received from the gateway, in microseconds since the epoch, or 0 if unknown.
+  int64_t received = 0;
+
+  /// The shard the payload was received on, or -1 if unknown.
+  int shard = -1;
 
   Packet() { }
 
@@ -66,30 +159,199 @@ class Packet {
     t = p.t;
     d = p.d;
     length = p.length;
+    received = p.received;
+    shard = p.shard;
 
     raw = static_cast<char *>(malloc(length * sizeof(char)));
     memcpy(raw, p.raw, p.length);
   }
 
+  Packet(Packet &&p) : op(p.op), s(p.s), t(std::move(p.t)), d(std::move(p.d)), raw(p.raw), length(p.length), received(p.received),
+      shard(p.shard) {
+    p.raw = nullptr;
+    p.length = 0;
+  }
+
   Packet &operator=(const Packet &p) {
+    if (this == &p) {
+      return *this;
+    }
+
     op = p.op;
     s = p.s;
     t = p.t;
     d = p.d;
     length = p.length;
+    received = p.received;
+    shard = p.shard;
 
+    free(raw);
     raw = static_cast<char *>(malloc(length * sizeof(char)));
     memcpy(raw, p.raw, p.length);
 
     return *this;
   }
 
+  Packet &operator=(Packet &&p) {
+    if (this == &p) {
+      return *this;
+    }
+
+    op = p.op;
+    s = p.s;
+    t = std::move(p.t);
+    d = std::move(p.d);
+    length = p.length;
+    received = p.received;
+    shard = p.shard;
+
+    free(raw);
+    raw = p.raw;
+    p.raw = nullptr;
+    p.length = 0;
+
+    return *this;
+  }
+
   /// Frees Packet#raw
   ~Packet() {
     free(raw);
   }
 };
 
+/// \brief A borrowed, non-owning view of a packet coming from a Connection or a brokers::Consumer.
+///
+/// Nothing is copied to build a view: PacketView#raw points into the receive buffer and PacketView#data refers to the
+/// already decoded payload, or is decoded from PacketView#raw on first access. A view is only valid for the duration of
+/// the handler it was passed to; use PacketView#retain or PacketView#toPacket to keep the data around for longer.
+class PacketView {
+ private:
+  mutable etf::Data *d = nullptr;
+  mutable std::shared_ptr<etf::Data> decoded;
+
+ public:
+  /// The payload opcode.
+  int op = 0;
+
+  /// \brief The sequence number.
+  ///
+  /// This is only sent for opcode 0. It will be set to -1 if not sent by discord.
+  int s = -1;
+
+  /// \brief The event name.
+  ///
+  /// This is only sent for opcode 0. It will be set to an empty string if not sent by discord.
+  std::string t = "";
+
+  /// The raw etf data.
+  const char *raw = nullptr;
+
+  /// The size of PacketView#raw
+  size_t length = 0;
+
+  /// When the payload was received from the gateway, in microseconds since the epoch, or 0 if unknown.
+  int64_t received = 0;
+
+  /// The shard the payload was received on, or -1 if unknown.
+  int shard = -1;
+
+  PacketView() { }
+
+  /// \brief Creates a view over already decoded data.
+  ///
+  /// \param[in] data   - The event data.
+  /// \param[in] raw    - The raw etf data.
+  /// \param[in] length - The size of raw.
+  PacketView(etf::Data *data, const char *raw_, size_t length_) : d(data), raw(raw_), length(length_) { }
+
+  /// \brief Creates a view that only decodes when PacketView#data is first called.
+  ///
+  /// \param[in] raw    - The raw etf data of a whole payload.
+  /// \param[in] length - The size of raw.
+  PacketView(const char *raw_, size_t length_) : raw(raw_), length(length_) { }
+
+  /// \brief Creates a view borrowing from a packet.
+  ///
+  /// \param[in] packet - The packet to borrow from. It must outlive the view.
+  explicit PacketView(Packet *packet) : d(&packet->d), op(packet->op), s(packet->s), t(packet->t), raw(packet->raw), length(packet->length),
+      received(packet->received), shard(packet->shard) { }
+
+  /// \brief The event data.
+  ///
+  /// For a lazy view, only the d field is decoded when it can be found without decoding the rest of the payload.
+  etf::Data &data() const {
+    if (!d) {
+      etf::Header header;
+      if (raw && etf::Scanner(raw, length).header(&header) && !header.d.empty()) {
+        etf::Decoder decoder(reinterpret_cast<const uint8_t *>(header.d.data), header.d.length, true);
+        decoded = std::make_shared<etf::Data>(decoder.unpack());
+        d = decoded.get();
+      } else {
+        etf::Decoder decoder(reinterpret_cast<const uint8_t *>(raw), length);
+        decoded = std::make_shared<etf::Data>(decoder.unpack());
+        d = &(*decoded)["d"];
+      }
+    }
+
+    return *d;
+  }
+
+  /// Copies PacketView#raw into a reference counted buffer which can outlive the view.
+  Buffer retain() const {
+    return Buffer(raw, length);
+  }
+
+  /// Copies the view into an owning Packet.
+  Packet toPacket() const {
+    Packet p;
+    p.op = op;
+    p.s = s;
+    p.t = t;
+    p.d = data();
+    p.length = length;
+    p.received = received;
+    p.shard = shard;
+
+    p.raw = static_cast<char *>(malloc(length * sizeof(char)));
+    memcpy(p.raw, raw, length);
+
+    return p;
+  }
+};
+
+/// A snapshot of the latency statistics of a Connection. Durations are in microseconds.
+struct Latency {
+  /// The number of acknowledged heartbeats.
+  uint64_t heartbeats = 0;
+
+  /// The round trip time of the most recent heartbeat.
+  uint64_t heartbeat_last = 0;
+
+  /// The median heartbeat round trip time.
+  uint64_t heartbeat_p50 = 0;
+
+  /// The 99th percentile heartbeat round trip time.
+  uint64_t heartbeat_p99 = 0;
+
+  /// The slowest heartbeat round trip time.
+  uint64_t heartbeat_max = 0;
+
+  /// Whether the most recent heartbeat has been acknowledged.
+  bool acked = true;
+
+  /// The median delay of the event loop behind its timers.
+  uint64_t loop_lag_p50 = 0;
+
+  /// The 99th percentile delay of the event loop behind its timers.
+  uint64_t loop_lag_p99 = 0;
+
+  /// The largest delay of the event loop behind its timers.
+  uint64_t loop_lag_max = 0;
+
+  /// The time since the last dispatch was received, or -1 if there has not been one yet.
+  int64_t since_dispatch = -1;
+};
+
 /// A connection to the Discord gateway.
 class Connection {
  private:
@@ -99,15 +361,68 @@ class Connection {
   int tries = 0;
   int seq = -1;
   bool open = false;
-  bool acked = true;
+  std::atomic<bool> acked{true};
   bool heartbeatStarted = false;
   bool heartbeatOpen = true;
+  bool ready = false;
+  std::mutex asyncMutex;
+  uS::Async *async = nullptr;
+  uS::Timer *throttle = nullptr;
+  TokenBucket bucket;
+  MPSCQueue<std::string> outbound;
+  MPSCQueue<std::string> control;
+  std::deque<std::string> pendingOutbound;
+  std::deque<std::string> pendingControl;
+  std::vector<std::string> allowedEvents;
+  std::vector<std::string> ignoredEvents;
+  Histogram heartbeatRtt;
+  Histogram loopLag;
+  std::atomic<int64_t> heartbeatSentAt{0};
+  std::atomic<uint64_t> lastHeartbeatRtt{0};
+  std::atomic<int64_t> lastDispatchAt{0};
+  uS::Timer *lagTimer = nullptr;
+  int64_t lagTick = 0;
+  uS::Timer *deferTimer = nullptr;
+  std::deque<std::pair<Buffer, int64_t>> deferred;
+
+  struct EventMetrics {
+    std::string name;
+    metrics::Counter *messages;
+    metrics::Counter *bytes;
+  };
+
+  std::vector<EventMetrics> eventMetrics;
+  metrics::Counter *filteredMetric = nullptr;
+  metrics::Counter *reconnectMetric = nullptr;
+  metrics::Gauge *queueMetric = nullptr;
+  Histogram *decodeMetric = nullptr;
   std::function<void()> errorHandler;
   std::function<void()> connectionHandler;
   std::function<void(int, std::string)> disconnectionHandler;
   std::function<void(Packet)> messageHandler;
+  std::function<void(const PacketView &)> viewHandler;
+
+  void enqueue(std::string frame, bool priority);
+  void enqueue(etf::Data data, bool priority);
+  void flush();
+  void closeHandles();
+  bool filtered(const etf::Slice &t) const;
+  void track(int s);
+  void forget();
+  void measureLag();
+  void count(const etf::Slice &event, size_t bytes);
+  void receive(char *raw, size_t length);
+  void handleDispatch(const char *raw, size_t length, int64_t received);
+  void drain();
+  void dispatched(int s, const etf::Slice &t, const etf::Slice &sessionId);
+  void deliver(etf::Data *d, int op, const char *raw, size_t length, int64_t received);
 
  public:
+  Connection() { }
+
+  Connection(const Connection &) = delete;
+  Connection &operator=(const Connection &) = delete;
+
   /// \brief Called when a WebSocket error occurs.
   //
   /// The client will not automatically reconnect when this is called.
@@ -130,11 +445,22 @@ class Connection {
   /// \param[in] handler - The event handler.
   void onMessage(std::function<void(Packet)> handler);
 
+  /// \brief Called when a message is received from the WebSocket, without copying it.
+  ///
+  /// The view borrows the receive buffer and is only valid until the handler returns.
+  ///
+  /// \param[in] handler - The event handler.
+  void onMessage(std::function<void(const PacketView &)> handler);
+
   /// \brief Sends data via the WebSocket.
+  ///
+  /// The data is copied into an outbound queue which is drained on the connection's own thread, so this may be
+  /// called from any thread. Commands are held back until the session is ready and are rate limited according
+  /// to Options#rate_limit; queued commands are written to the socket together.
   //
   /// \param[in] data   - The data to send.
   /// \param[in] length - The length of data.
-  void send(char *data, size_t length);
+  void send(const char *data, size_t length);
 
   /// \brief Sends data via the WebSocket.
   //
@@ -146,6 +472,11 @@ class Connection {
   /// \param[in] packet - The data to send.
   void send(Packet packet);
 
+  /// \brief Reports the latency statistics of this connection.
+  ///
+  /// Heartbeat round trips are measured from queueing the heartbeat to receiving its ACK. This may be called from any thread.
+  Latency latency() const;
+
   /// Sends an identify packet.
   void identify();
 
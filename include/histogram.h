@@ -0,0 +1,68 @@
+#ifndef SPECTACLES_INCLUDE_HISTOGRAM_H_
+#define SPECTACLES_INCLUDE_HISTOGRAM_H_
+
+#include <atomic>
+#include <cinttypes>
+
+/// \brief The spectacles namespace.
+///
+/// Everything public facing is under this namespace.
+namespace spectacles {
+
+/// \brief A lock-free histogram of unsigned values, such as latencies in microseconds.
+///
+/// Values are counted in log-linear buckets with eight buckets per power of two, so reported percentiles are
+/// within 12.5% of the true value. Any number of threads may record and read concurrently.
+class Histogram {
+ private:
+  static const int BUCKETS = 320;
+
+  std::atomic<uint64_t> buckets[BUCKETS];
+  std::atomic<uint64_t> total;
+  std::atomic<uint64_t> accumulated;
+  std::atomic<uint64_t> largest;
+
+  static int bucket(uint64_t value);
+  static uint64_t lowerBound(int bucket);
+
+ public:
+  /// Creates an empty histogram.
+  Histogram();
+
+  Histogram(const Histogram &) = delete;
+  Histogram &operator=(const Histogram &) = delete;
+
+  /// \brief Records a value.
+  ///
+  /// \param[in] value - The value to record.
+  void record(uint64_t value);
+
+  /// \brief Estimates a percentile.
+  ///
+  /// \param[in] p - The percentile, between 0 and 100.
+  /// \returns 0 if nothing was recorded.
+  uint64_t percentile(double p) const;
+
+  /// The number of recorded values.
+  uint64_t count() const;
+
+  /// The sum of every recorded value.
+  uint64_t sum() const;
+
+  /// The largest recorded value.
+  uint64_t max() const;
+
+  /// \brief Counts the values at or below a bound.
+  ///
+  /// Values are counted per bucket, so the result includes every bucket that starts at or below the bound.
+  ///
+  /// \param[in] bound - The inclusive upper bound.
+  uint64_t countBelow(uint64_t bound) const;
+
+  /// Forgets every recorded value.
+  void reset();
+};
+
+}  // namespace spectacles
+
+#endif  // SPECTACLES_INCLUDE_HISTOGRAM_H_
@@ -0,0 +1,166 @@
+#ifndef SPECTACLES_INCLUDE_METRICS_H_
+#define SPECTACLES_INCLUDE_METRICS_H_
+
+#include <atomic>
+#include <cinttypes>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+
+#include "histogram.h"
+
+/// \brief The spectacles namespace.
+///
+/// Everything public facing is under this namespace.
+namespace spectacles {
+
+/// \brief The metrics namespace.
+///
+/// Everything metrics related is under this namespace.
+namespace metrics {
+
+/// Label names and values attached to a metric.
+typedef std::map<std::string, std::string> Labels;
+
+/// \brief A monotonically increasing counter.
+///
+/// Each thread increments its own cache line, so hot paths on different threads never contend. Reading sums the shards.
+class Counter {
+ private:
+  static const int SHARDS = 16;
+
+  // Padded to a cache line, so increments from different threads never share one.
+  struct Shard {
+    std::atomic<uint64_t> value{0};
+    char padding[64 - sizeof(std::atomic<uint64_t>)];
+  };
+
+  Shard shards[SHARDS];
+
+ public:
+  Counter() { }
+
+  Counter(const Counter &) = delete;
+  Counter &operator=(const Counter &) = delete;
+
+  /// \brief Increments the counter.
+  ///
+  /// \param[in] n - The amount to add.
+  void add(uint64_t n = 1);
+
+  /// The current value.
+  uint64_t value() const;
+};
+
+/// A value that can go up and down, such as a queue depth.
+class Gauge {
+ private:
+  std::atomic<int64_t> current{0};
+
+ public:
+  Gauge() { }
+
+  Gauge(const Gauge &) = delete;
+  Gauge &operator=(const Gauge &) = delete;
+
+  /// Sets the value.
+  void set(int64_t value) {
+    current.store(value, std::memory_order_relaxed);
+  }
+
+  /// Adds to the value.
+  void add(int64_t n = 1) {
+    current.fetch_add(n, std::memory_order_relaxed);
+  }
+
+  /// The current value.
+  int64_t value() const {
+    return current.load(std::memory_order_relaxed);
+  }
+};
+
+/// \brief A collection of named metrics.
+///
+/// Looking a metric up takes a lock, so hot paths should look their metrics up once and keep the returned
+/// reference, which stays valid for the lifetime of the registry. A name belongs to the type it was first registered
+/// with; looking it up as another type is a bug, which asserts in debug builds and otherwise gets a metric that is
+/// never rendered.
+class Registry {
+ private:
+  enum Type {
+    COUNTER,
+    GAUGE,
+    SUMMARY,
+  };
+
+  struct Family {
+    Type type;
+    std::string help;
+    std::map<std::string, std::unique_ptr<Counter>> counters;
+    std::map<std::string, std::unique_ptr<Gauge>> gauges;
+    std::map<std::string, std::unique_ptr<Histogram>> summaries;
+  };
+
+  mutable std::mutex mutex;
+  std::map<std::string, Family> families;
+  std::map<std::string, Family> mismatched;
+
+  Family &family(const std::string &name, const std::string &help, Type type);
+
+ public:
+  Registry() { }
+
+  Registry(const Registry &) = delete;
+  Registry &operator=(const Registry &) = delete;
+
+  /// The registry shared by the whole process.
+  static Registry &global();
+
+  /// \brief Finds or creates a counter.
+  ///
+  /// \param[in] name   - The metric name.
+  /// \param[in] help   - The description, used when the metric is first created.
+  /// \param[in] labels - The labels identifying this counter within the metric.
+  Counter &counter(const std::string &name, const std::string &help, const Labels &labels = Labels());
+
+  /// \brief Finds or creates a gauge.
+  ///
+  /// \param[in] name   - The metric name.
+  /// \param[in] help   - The description, used when the metric is first created.
+  /// \param[in] labels - The labels identifying this gauge within the metric.
+  Gauge &gauge(const std::string &name, const std::string &help, const Labels &labels = Labels());
+
+  /// \brief Finds or creates a summary of durations.
+  ///
+  /// Values are recorded in microseconds and rendered in seconds.
+  ///
+  /// \param[in] name   - The metric name.
+  /// \param[in] help   - The description, used when the metric is first created.
+  /// \param[in] labels - The labels identifying this summary within the metric.
+  Histogram &summary(const std::string &name, const std::string &help, const Labels &labels = Labels());
+
+  /// Renders every metric in the Prometheus text exposition format.
+  std::string render() const;
+};
+
+/// \brief Serves a registry over HTTP for Prometheus to scrape.
+///
+/// \note The server spawns it's own thread.
+class Server {
+ public:
+  /// \brief Starts serving.
+  ///
+  /// Every request is answered with Registry#render, regardless of its path.
+  ///
+  /// \param[in] port     - The port to listen on.
+  /// \param[in] registry - The registry to serve.
+  /// \returns false if the port could not be bound.
+  bool listen(int port, Registry *registry = &Registry::global());
+};
+
+}  // namespace metrics
+
+}  // namespace spectacles
+
+#endif  // SPECTACLES_INCLUDE_METRICS_H_
@@ -0,0 +1,83 @@
+#ifndef SPECTACLES_INCLUDE_QUEUE_H_
+#define SPECTACLES_INCLUDE_QUEUE_H_
+
+#include <atomic>
+#include <utility>
+
+/// \brief The spectacles namespace.
+///
+/// Everything public facing is under this namespace.
+namespace spectacles {
+
+/// \brief An unbounded lock-free multi-producer, single-consumer queue.
+///
+/// Any number of threads may call MPSCQueue#push concurrently, but only one thread may call MPSCQueue#pop.
+/// Pushing never blocks and never spins; popping may briefly report the queue as empty while a push is in progress.
+template <typename T>
+class MPSCQueue {
+ private:
+  struct Node {
+    std::atomic<Node *> next;
+    T value;
+
+    Node() : next(nullptr) { }
+    explicit Node(T &&v) : next(nullptr), value(std::move(v)) { }
+  };
+
+  std::atomic<Node *> head;
+  Node *tail;
+
+ public:
+  /// Creates an empty queue.
+  MPSCQueue() {
+    Node *stub = new Node();
+    head.store(stub, std::memory_order_relaxed);
+    tail = stub;
+  }
+
+  MPSCQueue(const MPSCQueue &) = delete;
+  MPSCQueue &operator=(const MPSCQueue &) = delete;
+
+  /// Frees every node still in the queue.
+  ~MPSCQueue() {
+    T discard;
+    while (pop(&discard)) { }
+    delete tail;
+  }
+
+  /// \brief Adds a value to the back of the queue.
+  ///
+  /// \param[in] value - The value to add.
+  void push(T value) {
+    Node *node = new Node(std::move(value));
+    Node *prev = head.exchange(node, std::memory_order_acq_rel);
+    prev->next.store(node, std::memory_order_release);
+  }
+
+  /// \brief Removes a value from the front of the queue.
+  ///
+  /// \param[out] value - Where to move the value.
+  /// \returns false if the queue was empty.
+  bool pop(T *value) {
+    Node *next = tail->next.load(std::memory_order_acquire);
+    if (next == nullptr) {
+      return false;
+    }
+
+    *value = std::move(next->value);
+    delete tail;
+    tail = next;
+    return true;
+  }
+
+  /// \brief Checks whether the queue is empty.
+  ///
+  /// Only meaningful on the consumer thread.
+  bool empty() const {
+    return tail->next.load(std::memory_order_acquire) == nullptr;
+  }
+};
+
+}  // namespace spectacles
+
+#endif  // SPECTACLES_INCLUDE_QUEUE_H_
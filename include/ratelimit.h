@@ -0,0 +1,59 @@
+#ifndef SPECTACLES_INCLUDE_RATELIMIT_H_
+#define SPECTACLES_INCLUDE_RATELIMIT_H_
+
+#include <chrono>
+
+/// \brief The spectacles namespace.
+///
+/// Everything public facing is under this namespace.
+namespace spectacles {
+
+/// \brief A fixed window token bucket.
+///
+/// The bucket is refilled to its capacity once per interval. Part of the capacity can be reserved for priority
+/// takers, so ordinary traffic can never starve them.
+///
+/// \note This class is not thread safe.
+class TokenBucket {
+ private:
+  typedef std::chrono::steady_clock clock;
+
+  int capacity;
+  int reserved;
+  int tokens;
+  std::chrono::milliseconds interval;
+  clock::time_point windowStart;
+
+  void refill();
+
+ public:
+  /// \brief Creates a new token bucket.
+  ///
+  /// \param[in] capacity - The number of tokens available per interval.
+  /// \param[in] interval - The length of the interval in milliseconds.
+  /// \param[in] reserved - The number of tokens only priority takers may use.
+  TokenBucket(int capacity = 120, int interval = 60000, int reserved = 0);
+
+  /// \brief Changes the number of tokens only priority takers may use.
+  ///
+  /// \param[in] reserved - The number of reserved tokens.
+  void reserve(int reserved);
+
+  /// \brief Takes a token if one is available.
+  ///
+  /// \param[in] priority - Whether the reserved tokens may be used.
+  /// \returns true if a token was taken.
+  bool take(bool priority = false);
+
+  /// \brief The number of tokens that can currently be taken.
+  ///
+  /// \param[in] priority - Whether to count the reserved tokens.
+  int available(bool priority = false);
+
+  /// The number of milliseconds until the bucket is refilled.
+  int resetAfter();
+};
+
+}  // namespace spectacles
+
+#endif  // SPECTACLES_INCLUDE_RATELIMIT_H_
@@ -0,0 +1,144 @@
+#ifndef SPECTACLES_INCLUDE_RECORDER_H_
+#define SPECTACLES_INCLUDE_RECORDER_H_
+
+#include <atomic>
+#include <cinttypes>
+#include <functional>
+#include <mutex>
+#include <string>
+
+#include "gateway.h"
+
+/// \brief The spectacles namespace.
+///
+/// Everything public facing is under this namespace.
+namespace spectacles {
+
+/// \brief The gateway namespace.
+///
+/// Everything gateway related is under this namespace.
+namespace gateway {
+
+/// \brief Appends raw inbound gateway frames to a memory-mapped log.
+///
+/// Each frame is stored with the time it was received and the shard it came from. Appending is a copy into the
+/// mapping under a lock, and the file grows by doubling, so recording production traffic is cheap. Reopening an
+/// existing log appends to it.
+///
+/// \note Any number of connections may record into the same log.
+class Recorder {
+ private:
+  struct Layout {
+    uint32_t magic;
+    uint32_t version;
+    std::atomic<uint64_t> end;
+  };
+
+  mutable std::mutex mutex;
+  int fd = -1;
+  size_t size = 0;
+  Layout *layout = nullptr;
+
+  bool grow(size_t needed);
+  void drop();
+
+ public:
+  /// Creates a closed recorder.
+  Recorder() { }
+
+  Recorder(const Recorder &) = delete;
+  Recorder &operator=(const Recorder &) = delete;
+
+  /// Unmaps and closes the log, trimming it to the recorded frames.
+  ~Recorder();
+
+  /// \brief Opens or creates a log.
+  ///
+  /// \param[in] path     - The file to record to.
+  /// \param[in] capacity - The initial size of the file, in bytes.
+  /// \returns false if the file could not be opened or mapped, or is not a log.
+  bool open(const std::string &path, size_t capacity = 64 * 1024 * 1024);
+
+  /// \brief Appends a frame.
+  ///
+  /// \param[in] shard  - The shard the frame was received on.
+  /// \param[in] data   - The raw frame.
+  /// \param[in] length - The size of the frame.
+  void record(int shard, const char *data, size_t length);
+
+  /// The number of bytes recorded so far, including framing.
+  size_t recorded() const;
+};
+
+/// \brief Reads back a log written by a Recorder.
+class Replayer {
+ private:
+  int fd = -1;
+  size_t size = 0;
+  const char *memory = nullptr;
+  size_t offset = 0;
+
+  void drop();
+
+ public:
+  /// A recorded frame, pointing into the mapped log.
+  struct Frame {
+    /// When the frame was received, in nanoseconds since the epoch.
+    int64_t timestamp = 0;
+
+    /// The shard the frame was received on.
+    int shard = 0;
+
+    /// The raw frame.
+    const char *data = nullptr;
+
+    /// The size of Frame#data
+    size_t length = 0;
+  };
+
+  /// Creates a closed replayer.
+  Replayer() { }
+
+  Replayer(const Replayer &) = delete;
+  Replayer &operator=(const Replayer &) = delete;
+
+  /// Unmaps and closes the log.
+  ~Replayer();
+
+  /// \brief Opens a log.
+  ///
+  /// \param[in] path - The log to read.
+  /// \returns false if the file could not be opened or mapped, or is not a log.
+  bool open(const std::string &path);
+
+  /// \brief Reads the next frame.
+  ///
+  /// \param[out] frame - The frame, valid for as long as the replayer is open.
+  /// \returns false at the end of the log.
+  bool next(Frame *frame);
+
+  /// Goes back to the first frame.
+  void rewind();
+
+  /// \brief Feeds every remaining frame to a handler.
+  ///
+  /// \param[in] handler - Called with each frame.
+  /// \param[in] speed   - How fast to replay relative to the recording, or 0 to replay as fast as possible.
+  /// \returns The number of frames replayed.
+  size_t replay(std::function<void(const Frame &)> handler, double speed = 1);
+
+  /// \brief Decodes every remaining frame into a Packet and feeds it to a handler.
+  ///
+  /// Packets are built the same way Connection#onMessage builds them, so they can be handed straight to a Publisher.
+  ///
+  /// \param[in] handler - Called with the shard and the decoded packet.
+  /// \param[in] speed   - How fast to replay relative to the recording, or 0 to replay as fast as possible.
+  /// \returns The number of frames replayed.
+  size_t replay(std::function<void(int, Packet)> handler, double speed = 1);
+};
+
+}  // namespace gateway
+
+}  // namespace spectacles
+
+#endif  // SPECTACLES_INCLUDE_RECORDER_H_
@@ -0,0 +1,97 @@
+#ifndef SPECTACLES_INCLUDE_RING_H_
+#define SPECTACLES_INCLUDE_RING_H_
+
+#include <sys/types.h>
+
+#include <cinttypes>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "broker.h"
+
+/// \brief The spectacles namespace.
+///
+/// Everything public facing is under this namespace.
+namespace spectacles {
+
+/// \brief The brokers namespace.
+///
+/// Everything broker related is under this namespace.
+namespace brokers {
+
+/// \brief A Transport over a ring buffer in a shared memory file, for consumers on the same host as the publisher.
+///
+/// One process creates the ring and publishes into it; any number of processes attach to it and subscribe, each
+/// reading at its own pace without locks. The publisher never waits for readers: a reader that falls more than the
+/// ring's capacity behind skips ahead to the newest message and counts what it missed in Subscription#dropped.
+/// Subscriptions filter on routing key the same way queue bindings do. A publisher that restarts replaces the file,
+/// and subscriptions that go idle check for that and move over to the new ring.
+///
+/// \note Publishing is serialized by a mutex, so several threads of the creating process may publish. Only one
+/// process may publish into a ring.
+class SharedRing : public Transport {
+ private:
+  class Reader;
+
+  struct Header;
+
+  int fd = -1;
+  void *memory = nullptr;
+  size_t size = 0;
+  std::string path;
+  ino_t inode = 0;
+  Header *header = nullptr;
+  char *data = nullptr;
+  uint64_t capacity = 0;
+  bool writable = false;
+  uint64_t sequence = 0;
+  std::mutex mutex;
+
+  void drop();
+  static const Header *map(const std::string &path, size_t *size, ino_t *inode);
+
+ public:
+  SharedRing() { }
+
+  SharedRing(const SharedRing &) = delete;
+  SharedRing &operator=(const SharedRing &) = delete;
+
+  /// Unmaps the ring.
+  ~SharedRing();
+
+  /// \brief Creates a new ring to publish into, replacing any existing file.
+  ///
+  /// \param[in] path     - The file to create, best placed under /dev/shm.
+  /// \param[in] capacity - The size of the ring in bytes, which must be a power of two.
+  /// \returns false if the file could not be created.
+  bool create(const std::string &path, size_t capacity = 64 * 1024 * 1024);
+
+  /// \brief Maps an existing ring to subscribe to, read only.
+  ///
+  /// \param[in] path - The file created by SharedRing#create.
+  /// \returns false if the file is missing or not a ring.
+  bool attach(const std::string &path);
+
+  /// \brief Appends a message to the ring.
+  ///
+  /// \param[in] key    - The routing key.
+  /// \param[in] body   - The message body.
+  /// \param[in] length - The size of body.
+  /// \returns 0 if successful, or BROKER_TRANSPORT_ERROR if the ring isn't writable or the message is larger than half
+  /// of it.
+  Error publish(const std::string &key, const char *body, size_t length) override;
+
+  /// \brief Starts reading the messages published from now on.
+  ///
+  /// \param[in] keys - The routing keys to read, or an empty list for every message.
+  /// \returns nullptr if no ring is mapped.
+  std::unique_ptr<Subscription> subscribe(const std::vector<std::string> &keys) override;
+};
+
+}  // namespace brokers
+
+}  // namespace spectacles
+
+#endif  // SPECTACLES_INCLUDE_RING_H_
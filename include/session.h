@@ -0,0 +1,98 @@
+#ifndef SPECTACLES_INCLUDE_SESSION_H_
+#define SPECTACLES_INCLUDE_SESSION_H_
+
+#include <atomic>
+#include <cinttypes>
+#include <string>
+
+/// \brief The spectacles namespace.
+///
+/// Everything public facing is under this namespace.
+namespace spectacles {
+
+/// \brief The gateway namespace.
+///
+/// Everything gateway related is under this namespace.
+namespace gateway {
+
+/// \brief Persists the session ID and sequence number of every shard to a memory-mapped file.
+///
+/// A restarted process can use the stored sessions to resume instead of identifying again. Updating the sequence
+/// number is a pair of atomic stores into the mapping, so it is cheap enough to do on every dispatch; the kernel
+/// writes the pages back to disk even if the process crashes.
+///
+/// \note Each shard must only be written by one Connection at a time.
+class SessionStore {
+ private:
+  struct Record {
+    std::atomic<int32_t> seq;
+    std::atomic<uint32_t> length;
+    std::atomic<int64_t> updated;
+    char session[48];
+  };
+
+  struct Layout {
+    uint32_t magic;
+    uint32_t shards;
+    Record records[1];
+  };
+
+  int fd = -1;
+  size_t size = 0;
+  Layout *layout = nullptr;
+
+  Record *record(int shard);
+  void drop();
+
+ public:
+  /// Creates a closed store.
+  SessionStore() { }
+
+  SessionStore(const SessionStore &) = delete;
+  SessionStore &operator=(const SessionStore &) = delete;
+
+  /// Unmaps and closes the file.
+  ~SessionStore();
+
+  /// \brief Opens or creates the session file.
+  ///
+  /// A file created for a different number of shards is reset.
+  ///
+  /// \param[in] path       - The file to store sessions in.
+  /// \param[in] shardCount - The total number of shards.
+  /// \returns false if the file could not be opened or mapped.
+  bool open(const std::string &path, int shardCount);
+
+  /// \brief Loads a shard's session.
+  ///
+  /// \param[in]  shard   - The shard ID.
+  /// \param[in]  maxAge  - How old the last update may be, in milliseconds, for the session to still be resumable.
+  /// \param[out] session - The session ID.
+  /// \param[out] seq     - The last sequence number.
+  /// \returns false if there is no session, or it is too old to resume.
+  bool load(int shard, int maxAge, std::string *session, int *seq);
+
+  /// \brief Saves a new session for a shard.
+  ///
+  /// \param[in] shard   - The shard ID.
+  /// \param[in] session - The session ID.
+  /// \param[in] seq     - The sequence number.
+  void save(int shard, const std::string &session, int seq);
+
+  /// \brief Records a new sequence number for a shard.
+  ///
+  /// \param[in] shard - The shard ID.
+  /// \param[in] seq   - The sequence number.
+  void update(int shard, int seq);
+
+  /// \brief Forgets a shard's session.
+  ///
+  /// \param[in] shard - The shard ID.
+  void clear(int shard);
+};
+
+}  // namespace gateway
+
+}  // namespace spectacles
+
+#endif  // SPECTACLES_INCLUDE_SESSION_H_
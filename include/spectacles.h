@@ -2,7 +2,10 @@
 #define SPECTACLES_INCLUDE_SPECTACLES_H_
 
 #include "broker.h"
+#include "coalescer.h"
 #include "gateway.h"
+#include "recorder.h"
+#include "ring.h"
 #include "etf/etf.h"
 
 #endif  // SPECTACLES_INCLUDE_SPECTACLES_H_
@@ -0,0 +1,139 @@
+#ifndef SPECTACLES_INCLUDE_SPILL_H_
+#define SPECTACLES_INCLUDE_SPILL_H_
+
+#include <cinttypes>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <vector>
+
+/// \brief The spectacles namespace.
+///
+/// Everything public facing is under this namespace.
+namespace spectacles {
+
+/// \brief The brokers namespace.
+///
+/// Everything broker related is under this namespace.
+namespace brokers {
+
+/// \brief A FIFO of outgoing messages that overflows from memory to disk.
+///
+/// Messages are kept in a bounded ring in memory. Once the ring is full, and for as long as anything is left on disk,
+/// messages are appended to memory-mapped segment files instead, so order is kept across both. Segments are rotated
+/// at a fixed size and deleted once drained. Segments left behind by a previous process are picked up again when the
+/// queue is opened, and whatever is still in memory is written out when the queue is destroyed. A segment cut short by
+/// a crash is read up to its last whole record.
+///
+/// \note Any number of threads may push, but only one may take messages off the front.
+class SpillQueue {
+ public:
+  /// A queued message.
+  struct Message {
+    /// The routing key.
+    std::string key;
+
+    /// The message body.
+    std::string body;
+  };
+
+ private:
+  struct Segment {
+    uint64_t index;
+    int fd;
+    char *memory;
+    size_t size;
+    size_t records = 0;
+  };
+
+  struct SegmentHeader {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t end;
+    uint64_t read;
+  };
+
+  mutable std::mutex mutex;
+  std::condition_variable ready;
+  bool closed = false;
+
+  std::vector<Message> ring;
+  size_t head = 0;
+  size_t count = 0;
+  uint64_t taken = 0;
+
+  std::string directory;
+  size_t segmentSize;
+  std::deque<Segment> segments;
+  size_t onDisk = 0;
+  uint64_t nextIndex = 1ULL << 32;
+
+  std::string path(uint64_t index) const;
+  bool map(Segment *segment, bool create);
+  bool append(Segment *segment, const std::string &key, const std::string &body);
+  void unmap(Segment *segment, bool remove);
+  void discard();
+  bool spill(const std::string &key, const std::string &body);
+  void persist();
+
+ public:
+  /// \brief Creates a queue that only spills once opened.
+  ///
+  /// \param[in] capacity    - The number of messages held in memory.
+  /// \param[in] segmentSize - The size of each segment file, in bytes.
+  explicit SpillQueue(size_t capacity = 65536, size_t segmentSize = 64 * 1024 * 1024);
+
+  SpillQueue(const SpillQueue &) = delete;
+  SpillQueue &operator=(const SpillQueue &) = delete;
+
+  /// Writes the messages still in memory to disk, if open, and unmaps every segment.
+  ~SpillQueue();
+
+  /// \brief Opens the directory to spill into, picking up the segments already in it.
+  ///
+  /// \param[in] directory - The directory, which is created if missing.
+  /// \returns false if the directory or a segment in it could not be opened.
+  bool open(const std::string &directory);
+
+  /// \brief Adds a message to the back of the queue.
+  ///
+  /// Never waits on the consumer. When the ring is full and nothing can be spilled the oldest message in memory is
+  /// dropped. While older messages are on disk, a message that cannot be spilled is dropped itself, as keeping it in
+  /// memory would let it overtake them.
+  ///
+  /// \param[in] key  - The routing key.
+  /// \param[in] body - The message body.
+  /// \returns false if a message had to be dropped.
+  bool push(std::string key, std::string body);
+
+  /// \brief Copies the message at the front of the queue without removing it.
+  ///
+  /// \param[out] out      - The message.
+  /// \param[out] position - Where the message is in the queue, to pass to SpillQueue#pop.
+  /// \param[in]  timeout  - How long to wait for a message, in milliseconds.
+  /// \returns false if the queue stayed empty or was closed.
+  bool front(Message *out, uint64_t *position, int timeout);
+
+  /// \brief Removes the message returned by SpillQueue#front.
+  ///
+  /// Does nothing if that message is no longer at the front, because SpillQueue#push dropped it meanwhile.
+  ///
+  /// \param[in] position - The position SpillQueue#front gave out.
+  void pop(uint64_t position);
+
+  /// Wakes up and fails every pending and future SpillQueue#front.
+  void close();
+
+  /// The number of queued messages.
+  size_t size() const;
+
+  /// The number of queued messages that are on disk.
+  size_t spilled() const;
+};
+
+}  // namespace brokers
+
+}  // namespace spectacles
+
+#endif  // SPECTACLES_INCLUDE_SPILL_H_
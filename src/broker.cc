@@ -1,8 +1,11 @@
+#include <algorithm>
+#include <chrono>
 #include <string>
 #include <thread>
 
 #include <amqp.h>
 #include <amqp_tcp_socket.h>
+#include <zlib.h>
 
 #include <set>
 #include <vector>
@@ -17,19 +20,105 @@ namespace spectacles {
 
 namespace brokers {
 
-Error Publisher::connect(std::string hostname, int port, std::string g, std::set<std::string> s) {
+// The start of a batch, {batch, [d, ...]}, up to the length of the list.
+static const char BATCH_PREFIX[] = {
+  static_cast<char>(FORMAT_VERSION), SMALL_TUPLE_EXT, 2, SMALL_ATOM_EXT, 5, 'b', 'a', 't', 'c', 'h', LIST_EXT
+};
+
+static int64_t micros() {
+  return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static int64_t wallMicros() {
+  return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+}
+
+static Trace traceOf(const gateway::PacketView &p) {
+  Trace trace;
+  trace.received = p.received;
+  trace.shard = p.shard;
+  trace.sequence = p.s;
+  return trace;
+}
+
+// Puts a trace in the headers of props, using entries for the table. Returns nullptr when there is nothing to trace,
+// so messages from elsewhere are published without properties as before.
+static amqp_basic_properties_t *traceProperties(const Trace &trace, amqp_basic_properties_t *props, amqp_table_entry_t (&entries)[3]) {
+  if (trace.received == 0) {
+    return nullptr;
+  }
+
+  entries[0].key = amqp_cstring_bytes("received_at");
+  entries[0].value.kind = AMQP_FIELD_KIND_I64;
+  entries[0].value.value.i64 = trace.received;
+  entries[1].key = amqp_cstring_bytes("shard_id");
+  entries[1].value.kind = AMQP_FIELD_KIND_I32;
+  entries[1].value.value.i32 = trace.shard;
+  entries[2].key = amqp_cstring_bytes("sequence");
+  entries[2].value.kind = AMQP_FIELD_KIND_I32;
+  entries[2].value.value.i32 = trace.sequence;
+
+  props->_flags = AMQP_BASIC_HEADERS_FLAG;
+  props->headers.num_entries = 3;
+  props->headers.entries = entries;
+  return props;
+}
+
+// Reads back what traceProperties() wrote. Integers are taken at any width, as brokers may widen them.
+static Trace traceFrom(const amqp_basic_properties_t &props) {
+  Trace trace;
+  if (!(props._flags & AMQP_BASIC_HEADERS_FLAG)) {
+    return trace;
+  }
+
+  for (int i = 0; i < props.headers.num_entries; i++) {
+    const amqp_table_entry_t &entry = props.headers.entries[i];
+
+    int64_t value;
+    switch (entry.value.kind) {
+      case AMQP_FIELD_KIND_I64:
+        value = entry.value.value.i64;
+        break;
+      case AMQP_FIELD_KIND_TIMESTAMP:
+        value = static_cast<int64_t>(entry.value.value.u64);
+        break;
+      case AMQP_FIELD_KIND_I32:
+        value = entry.value.value.i32;
+        break;
+      case AMQP_FIELD_KIND_U32:
+        value = entry.value.value.u32;
+        break;
+      default:
+        continue;
+    }
+
+    std::string key(static_cast<const char *>(entry.key.bytes), entry.key.len);
+    if (key == "received_at") {
+      trace.received = value;
+    } else if (key == "shard_id") {
+      trace.shard = static_cast<int32_t>(value);
+    } else if (key == "sequence") {
+      trace.sequence = static_cast<int32_t>(value);
+    }
+  }
+
+  return trace;
+}
+
+// Opens a connection with channels 1 to channels, on each of which confirms are selected if asked for, and declares
+// the exchange. On failure the connection is destroyed and left as nullptr.
+static Error login(amqp_connection_state_t *out, const std::string &hostname, int port, const std::string &exchange, int channels, bool confirms) {
   Error e;
-  group = g;
-  events = s;
 
   amqp_socket_t *socket = nullptr;
   amqp_rpc_reply_t reply;
 
-  conn = amqp_new_connection();
+  amqp_connection_state_t conn = amqp_new_connection();
 
   socket = amqp_tcp_socket_new(conn);
   if (!socket) {
     e.type = BROKER_TCP_SOCKET_ERROR;
+    amqp_destroy_connection(conn);
     return e;
   }
 
@@ -38,6 +127,7 @@ Error Publisher::connect(std::string hostname, int port, std::string g, std::set
     e.context = "opening TCP socket";
     e.type = BROKER_AMQP_STATUS_ERROR;
     e.amqpStatus = static_cast<amqp_status_enum>(status);
+    amqp_destroy_connection(conn);
     return e;
   }
 
@@ -46,31 +136,233 @@ Error Publisher::connect(std::string hostname, int port, std::string g, std::set
     e.context = "Logging in";
     e.type = BROKER_RPC_ERROR;
     e.reply = reply;
+    amqp_destroy_connection(conn);
     return e;
   }
 
-  amqp_channel_open(conn, 1);
-  reply = amqp_get_rpc_reply(conn);
-  if (reply.reply_type != AMQP_RESPONSE_NORMAL) {
-    e.context = "Opening channel";
-    e.type = BROKER_RPC_ERROR;
-    e.reply = reply;
-    return e;
+  for (int channel = 1; channel <= channels; channel++) {
+    amqp_channel_open(conn, channel);
+    reply = amqp_get_rpc_reply(conn);
+    if (reply.reply_type != AMQP_RESPONSE_NORMAL) {
+      e.context = "Opening channel";
+      e.type = BROKER_RPC_ERROR;
+      e.reply = reply;
+      amqp_destroy_connection(conn);
+      return e;
+    }
+
+    if (confirms) {
+      amqp_confirm_select(conn, channel);
+      reply = amqp_get_rpc_reply(conn);
+      if (reply.reply_type != AMQP_RESPONSE_NORMAL) {
+        e.context = "Selecting confirms";
+        e.type = BROKER_RPC_ERROR;
+        e.reply = reply;
+        amqp_destroy_connection(conn);
+        return e;
+      }
+    }
   }
 
-  amqp_exchange_declare(conn, 1, amqp_cstring_bytes(group.c_str()), amqp_cstring_bytes("direct"), 0, 1, 0, 0, amqp_empty_table);
+  amqp_exchange_declare(conn, 1, amqp_cstring_bytes(exchange.c_str()), amqp_cstring_bytes("direct"), 0, 1, 0, 0, amqp_empty_table);
   reply = amqp_get_rpc_reply(conn);
   if (reply.reply_type != AMQP_RESPONSE_NORMAL) {
     e.context = "Declaring exchange";
     e.type = BROKER_RPC_ERROR;
     e.reply = reply;
+    amqp_destroy_connection(conn);
     return e;
   }
 
+  *out = conn;
   return e;
 }
 
+// The payload already holds d encoded, so it's republished as is behind a version byte. The buffer only grows, which
+// leaves nothing to allocate once it has seen the largest event.
+static void encode(const gateway::PacketView &p, std::string *out) {
+  etf::Header header;
+  if (p.raw && etf::Scanner(p.raw, p.length).header(&header) && !header.d.empty()) {
+    out->assign(1, static_cast<char>(FORMAT_VERSION));
+    out->append(header.d.data, header.d.length);
+  } else {
+    etf::Encoder e;
+    e.pack(p.data());
+
+    etf::out_buf buf = e.release();
+    out->assign(buf.buf, buf.length);
+    free(buf.buf);
+  }
+}
+
+int32_t partitionOf(uint64_t guild, int32_t partitions) {
+  int64_t b = -1, j = 0;
+  while (j < partitions) {
+    b = j;
+    guild = guild * 2862933555777941757ULL + 1;
+    j = static_cast<int64_t>((b + 1) * (static_cast<double>(1LL << 31) / static_cast<double>((guild >> 33) + 1)));
+  }
+
+  return static_cast<int32_t>(b < 0 ? 0 : b);
+}
+
+// Appends the partition of the event's guild to its name. The body is encoded event data, as made by encode().
+static std::string routingKey(const std::string &event, const std::string &body, int32_t partitions) {
+  uint64_t guild = 0;
+  etf::Scanner d(body.data(), body.size());
+  if (d.find("guild_id")) {
+    d.snowflake(&guild);
+  }
+
+  return event + "." + std::to_string(partitionOf(guild, partitions));
+}
+
+// The event name a routing key was made from by routingKey().
+static std::string eventOf(const std::string &key) {
+  return key.substr(0, key.rfind('.'));
+}
+
+// Wraps an encoded term in a COMPRESSED term. Returns false if that didn't make it any smaller.
+static bool deflateTerm(const std::string &in, std::string *out, int level) {
+  uLongf size = compressBound(in.size() - 1);
+  out->resize(6 + size);
+
+  const unsigned char *source = reinterpret_cast<const unsigned char *>(in.data()) + 1;
+  unsigned char *dest = reinterpret_cast<unsigned char *>(&(*out)[6]);
+  if (compress2(dest, &size, source, in.size() - 1, level) != Z_OK || 6 + size >= in.size()) {
+    return false;
+  }
+
+  uint32_t length = in.size() - 1;
+  (*out)[0] = static_cast<char>(FORMAT_VERSION);
+  (*out)[1] = COMPRESSED;
+  (*out)[2] = static_cast<char>(length >> 24);
+  (*out)[3] = static_cast<char>(length >> 16);
+  (*out)[4] = static_cast<char>(length >> 8);
+  (*out)[5] = static_cast<char>(length);
+  out->resize(6 + size);
+  return true;
+}
+
+// Anything claiming to inflate to more than this is taken to be corrupt.
+static const uint32_t MAX_INFLATED = 256 * 1024 * 1024;
+
+// Unwraps a COMPRESSED term into a version byte followed by the term it holds.
+static bool inflateTerm(const char *in, size_t length, std::vector<char> *out) {
+  uint32_t size = (static_cast<uint32_t>(static_cast<uint8_t>(in[2])) << 24) | (static_cast<uint32_t>(static_cast<uint8_t>(in[3])) << 16)
+    | (static_cast<uint32_t>(static_cast<uint8_t>(in[4])) << 8) | static_cast<uint8_t>(in[5]);
+  if (size > MAX_INFLATED) {
+    return false;
+  }
+
+  out->resize(1 + size);
+  (*out)[0] = static_cast<char>(FORMAT_VERSION);
+
+  uLongf written = size;
+  int status = uncompress(reinterpret_cast<unsigned char *>(out->data() + 1), &written, reinterpret_cast<const unsigned char *>(in + 6), length - 6);
+  return status == Z_OK && written == size;
+}
+
+Error Publisher::connect(std::string h, int p, std::string g, std::set<std::string> s) {
+  hostname = h;
+  port = p;
+  group = g;
+  events = s;
+  useMetrics(registry);
+
+  return open();
+}
+
+Error Publisher::open() {
+  disconnect();
+  return login(&conn, hostname, port, group, 1, window > 0);
+}
+
+void Publisher::disconnect() {
+  if (conn) {
+    amqp_destroy_connection(conn);
+    conn = nullptr;
+  }
+}
+
+void Publisher::useMetrics(metrics::Registry *r) {
+  registry = r;
+  eventMetrics.clear();
+  errorMetric = nullptr;
+  latencyMetric = nullptr;
+  spilledMetric = nullptr;
+  compressMetric = nullptr;
+  compressInMetric = nullptr;
+  compressOutMetric = nullptr;
+
+  if (registry) {
+    metrics::Labels labels = {{"exchange", group}};
+    errorMetric = &registry->counter("spectacles_broker_publish_errors_total", "Messages that failed to publish.", labels);
+    latencyMetric = &registry->summary("spectacles_broker_publish_seconds", "Time spent publishing a message.", labels);
+    spilledMetric = &registry->gauge("spectacles_broker_spilled_messages", "Messages waiting to be published that were spilled to disk.", labels);
+    compressMetric = &registry->summary("spectacles_broker_compress_seconds", "Time spent compressing messages.", labels);
+    compressInMetric = &registry->counter("spectacles_broker_compress_input_bytes_total", "Bytes of messages before compression.", labels);
+    compressOutMetric = &registry->counter("spectacles_broker_compress_output_bytes_total", "Bytes of messages after compression.", labels);
+  }
+}
+
+void Publisher::useTransport(Transport *t) {
+  transport = t;
+}
+
+void Publisher::partition(int32_t p) {
+  partitions = p;
+}
+
+void Publisher::compress(size_t threshold, int level) {
+  compressThreshold = threshold;
+  compressLevel = level;
+}
+
+void Publisher::count(const std::string &key, size_t bytes) {
+  auto it = eventMetrics.find(key);
+  if (it == eventMetrics.end()) {
+    metrics::Labels labels = {{"exchange", group}, {"event", partitions > 0 ? eventOf(key) : key}};
+    metrics::Counter *messages = &registry->counter("spectacles_broker_published_total", "Messages published to the broker.", labels);
+    metrics::Counter *b = &registry->counter("spectacles_broker_published_bytes_total", "Bytes published to the broker.", labels);
+    it = eventMetrics.insert(std::make_pair(key, std::make_pair(messages, b))).first;
+  }
+
+  it->second.first->add();
+  it->second.second->add(bytes);
+}
+
 Publisher::~Publisher() {
+  // Pending batches are flushed first, while there's still something to publish them through.
+  if (batcher.joinable()) {
+    {
+      std::lock_guard<std::mutex> lock(batchMutex);
+      batching = false;
+    }
+
+    batchReady.notify_one();
+    batcher.join();
+  }
+
+  if (drainer.joinable()) {
+    {
+      std::lock_guard<std::mutex> lock(outgoingMutex);
+      draining = false;
+    }
+
+    if (queue) {
+      queue->close();
+    }
+
+    outgoingReady.notify_all();
+    outgoingSpace.notify_all();
+    drainer.join();
+  }
+
+  if (!conn) {
+    return;
+  }
+
   amqp_rpc_reply_t reply;
 
   reply = amqp_channel_close(conn, 1, AMQP_REPLY_SUCCESS);
@@ -86,7 +378,330 @@ Publisher::~Publisher() {
   amqp_destroy_connection(conn);
 }
 
+bool Publisher::spill(const std::string &directory, size_t capacity, size_t segmentSize) {
+  if (queue || window > 0) {
+    return false;
+  }
+
+  std::unique_ptr<SpillQueue> q(new SpillQueue(capacity, segmentSize));
+  if (!q->open(directory)) {
+    return false;
+  }
+
+  queue = std::move(q);
+  draining = true;
+  drainer = std::thread([this]() {
+    drain();
+  });
+
+  return true;
+}
+
+bool Publisher::pipeline(size_t w) {
+  if (queue || window > 0 || w == 0) {
+    return false;
+  }
+
+  // Confirm mode has to be selected on the channel, and open() does so on every connection from here on.
+  window = w;
+  disconnect();
+
+  draining = true;
+  drainer = std::thread([this]() {
+    pump();
+  });
+
+  return true;
+}
+
+size_t Publisher::pending() const {
+  if (queue) {
+    return queue->size();
+  }
+
+  std::lock_guard<std::mutex> lock(outgoingMutex);
+  return outstanding;
+}
+
+void Publisher::finish(std::vector<Outgoing> *done, Error err) {
+  if (done->empty()) {
+    return;
+  }
+
+  for (Outgoing &o : *done) {
+    if (registry) {
+      if (err.type == BROKER_OK) {
+        latencyMetric->record(micros() - o.queued);
+        count(o.key, o.body.size());
+      } else {
+        errorMetric->add();
+      }
+    }
+
+    if (o.done) {
+      o.done(err);
+    }
+  }
+
+  {
+    std::lock_guard<std::mutex> lock(outgoingMutex);
+    outstanding -= done->size();
+  }
+
+  outgoingSpace.notify_all();
+  done->clear();
+}
+
+void Publisher::complete(uint64_t tag, bool multiple, Error err) {
+  std::vector<Outgoing> done;
+
+  auto end = inflight.upper_bound(tag);
+  auto begin = multiple ? inflight.begin() : inflight.find(tag);
+  if (begin == inflight.end()) {
+    return;
+  }
+
+  if (!multiple) {
+    end = std::next(begin);
+  }
+
+  for (auto it = begin; it != end; it++) {
+    done.push_back(std::move(it->second));
+  }
+
+  inflight.erase(begin, end);
+  finish(&done, err);
+}
+
+void Publisher::pump() {
+  int backoff = 100;
+  std::vector<Outgoing> batch;
+
+  auto wait = [this](int ms) {
+    for (int waited = 0; waited < ms && draining; waited += 100) {
+      std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    }
+  };
+
+  // Puts everything unconfirmed back in front of the queue, in the order it was first published.
+  auto requeue = [this, &batch]() {
+    std::lock_guard<std::mutex> lock(outgoingMutex);
+    for (auto it = batch.rbegin(); it != batch.rend(); it++) {
+      outgoing.push_front(std::move(*it));
+    }
+
+    for (auto it = inflight.rbegin(); it != inflight.rend(); it++) {
+      outgoing.push_front(std::move(it->second));
+    }
+
+    batch.clear();
+    inflight.clear();
+    nextTag = 1;
+  };
+
+  while (draining) {
+    if (!conn) {
+      Error e = open();
+      if (e.type != BROKER_OK) {
+        wait(backoff);
+        backoff = std::min(backoff * 2, 10000);
+        continue;
+      }
+
+      backoff = 100;
+    }
+
+    {
+      std::unique_lock<std::mutex> lock(outgoingMutex);
+      if (outgoing.empty() && inflight.empty()) {
+        outgoingReady.wait_for(lock, std::chrono::milliseconds(100));
+      }
+
+      while (!outgoing.empty() && batch.size() < 64) {
+        batch.push_back(std::move(outgoing.front()));
+        outgoing.pop_front();
+      }
+    }
+
+    bool failed = false;
+    size_t sent = 0;
+    for (; sent < batch.size(); sent++) {
+      Outgoing &o = batch[sent];
+
+      amqp_bytes_t body;
+      body.len = o.body.size();
+      body.bytes = const_cast<char *>(o.body.data());
+
+      amqp_basic_properties_t props;
+      amqp_table_entry_t headers[3];
+      amqp_basic_properties_t *traced = traceProperties(o.trace, &props, headers);
+
+      if (amqp_basic_publish(conn, 1, amqp_cstring_bytes(group.c_str()), amqp_cstring_bytes(o.key.c_str()), 0, 0, traced, body) != AMQP_STATUS_OK) {
+        failed = true;
+        break;
+      }
+
+      inflight.insert(std::make_pair(nextTag++, std::move(o)));
+    }
+
+    batch.erase(batch.begin(), batch.begin() + sent);
+
+    // Confirms are read without blocking while there is more to publish, and briefly waited for otherwise.
+    bool idle = sent == 0;
+    while (!failed && !inflight.empty()) {
+      struct timeval timeout;
+      timeout.tv_sec = 0;
+      timeout.tv_usec = idle ? 5000 : 0;
+      idle = false;
+
+      amqp_frame_t frame;
+      int status = amqp_simple_wait_frame_noblock(conn, &frame, &timeout);
+      if (status == AMQP_STATUS_TIMEOUT) {
+        break;
+      } else if (status != AMQP_STATUS_OK) {
+        failed = true;
+        break;
+      }
+
+      if (frame.frame_type != AMQP_FRAME_METHOD) {
+        continue;
+      }
+
+      switch (frame.payload.method.id) {
+        case AMQP_BASIC_ACK_METHOD: {
+          amqp_basic_ack_t *ack = static_cast<amqp_basic_ack_t *>(frame.payload.method.decoded);
+          complete(ack->delivery_tag, ack->multiple, Error());
+          break;
+        }
+        case AMQP_BASIC_NACK_METHOD: {
+          amqp_basic_nack_t *nack = static_cast<amqp_basic_nack_t *>(frame.payload.method.decoded);
+          Error err;
+          err.context = "Confirming";
+          err.type = BROKER_NACK_ERROR;
+          complete(nack->delivery_tag, nack->multiple, err);
+          break;
+        }
+        case AMQP_CHANNEL_CLOSE_METHOD:
+        case AMQP_CONNECTION_CLOSE_METHOD:
+          failed = true;
+          break;
+      }
+    }
+
+    if (failed) {
+      requeue();
+      disconnect();
+      wait(backoff);
+      backoff = std::min(backoff * 2, 10000);
+    }
+  }
+
+  Error err;
+  err.context = "Closing";
+  err.type = BROKER_CLOSED_ERROR;
+
+  for (auto &it : inflight) {
+    batch.push_back(std::move(it.second));
+  }
+  inflight.clear();
+
+  {
+    std::lock_guard<std::mutex> lock(outgoingMutex);
+    for (Outgoing &o : outgoing) {
+      batch.push_back(std::move(o));
+    }
+    outgoing.clear();
+  }
+
+  finish(&batch, err);
+}
+
+void Publisher::drain() {
+  int backoff = 100;
+  SpillQueue::Message m;
+  uint64_t position = 0;
+
+  auto wait = [this](int ms) {
+    for (int waited = 0; waited < ms && draining; waited += 100) {
+      std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    }
+  };
+
+  while (draining) {
+    if (!queue->front(&m, &position, 100)) {
+      continue;
+    }
+
+    Error e;
+    if (!conn) {
+      e = open();
+    }
+
+    if (e.type == BROKER_OK) {
+      amqp_bytes_t body;
+      body.len = m.body.size();
+      body.bytes = const_cast<char *>(m.body.data());
+
+      e = send(m.key, body);
+    }
+
+    if (e.type == BROKER_OK) {
+      queue->pop(position);
+      backoff = 100;
+    } else {
+      // The broker is gone or refusing us; keep the message at the front and try again on a new connection.
+      disconnect();
+      wait(backoff);
+      backoff = std::min(backoff * 2, 10000);
+    }
+
+    if (spilledMetric) {
+      spilledMetric->set(queue->spilled());
+    }
+  }
+}
+
+Error Publisher::send(const std::string &event, amqp_bytes_t body, const Trace &trace) {
+  Error err;
+
+  int64_t start = registry ? micros() : 0;
+
+  if (transport) {
+    err = transport->publish(event, static_cast<const char *>(body.bytes), body.len);
+  } else {
+    amqp_basic_properties_t props;
+    amqp_table_entry_t headers[3];
+    int status = amqp_basic_publish(conn, 1, amqp_cstring_bytes(group.c_str()), amqp_cstring_bytes(event.c_str()), 0, 0,
+      traceProperties(trace, &props, headers), body);
+    if (status != AMQP_STATUS_OK) {
+      err.context = "Publishing";
+      err.type = BROKER_AMQP_STATUS_ERROR;
+      err.amqpStatus = static_cast<amqp_status_enum>(status);
+    }
+  }
+
+  if (registry) {
+    latencyMetric->record(micros() - start);
+
+    if (err.type == BROKER_OK) {
+      count(event, body.len);
+    } else {
+      errorMetric->add();
+    }
+  }
+
+  return err;
+}
+
 Error Publisher::publish(gateway::Packet p) {
+  return publish(gateway::PacketView(&p));
+}
+
+Error Publisher::publish(const gateway::PacketView &p) {
+  return publish(p, nullptr);
+}
+
+Error Publisher::publish(const gateway::PacketView &p, std::function<void(Error)> done) {
   Error err;
   if (p.op != 0) {
     return err;
@@ -96,29 +711,198 @@ Error Publisher::publish(gateway::Packet p) {
     return err;
   }
 
-  amqp_bytes_t message_bytes;
+  thread_local std::string scratch;
+  encode(p, &scratch);
 
-  etf::Encoder e;
-  e.pack(p.d);
+  std::string key = partitions > 0 ? routingKey(p.t, scratch, partitions) : p.t;
 
-  etf::out_buf buf = e.release();
+  if (batchBytes == 0 || (batchEvents.size() != 0 && batchEvents.count(p.t) == 0)) {
+    return emit(key, scratch, std::move(done), traceOf(p));
+  }
 
-  message_bytes.len = buf.length;
-  message_bytes.bytes = buf.buf;
+  // Batches are kept per routing key, so a partition's batch only holds events of its own guilds.
+  Batch full;
+  {
+    std::lock_guard<std::mutex> lock(batchMutex);
+    Batch &b = batches[key];
+    if (b.count == 0) {
+      b.deadline = micros() + batchDelay * 1000;
+      b.trace = traceOf(p);
+      batchReady.notify_one();
+    }
 
+    // Batched events go in without their version byte, as elements of the list.
+    b.body.append(scratch.data() + 1, scratch.size() - 1);
+    b.count++;
+    if (done) {
+      b.done.push_back(std::move(done));
+    }
 
-  int status = amqp_basic_publish(conn, 1, amqp_cstring_bytes(group.c_str()), amqp_cstring_bytes(p.t.c_str()), 0, 0, nullptr, message_bytes);
-  if (status != AMQP_STATUS_OK) {
-    err.context = "Publishing";
-    err.type = BROKER_AMQP_STATUS_ERROR;
-    err.amqpStatus = static_cast<amqp_status_enum>(status);
+    if (b.body.size() < batchBytes) {
+      return err;
+    }
+
+    full = std::move(b);
+    b = Batch();
+  }
+
+  return flush(key, &full);
+}
+
+Error Publisher::emit(const std::string &event, const std::string &raw, std::function<void(Error)> done, const Trace &trace) {
+  Error err;
+
+  thread_local std::string packed;
+  const std::string *message = &raw;
+  if (compressThreshold > 0 && raw.size() >= compressThreshold) {
+    int64_t start = registry ? micros() : 0;
+    if (deflateTerm(raw, &packed, compressLevel)) {
+      message = &packed;
+    }
+
+    if (registry) {
+      compressMetric->record(micros() - start);
+      compressInMetric->add(raw.size());
+      compressOutMetric->add(message->size());
+    }
+  }
+
+  const std::string &body = *message;
+
+  if (window > 0) {
+    Outgoing o;
+    o.key = event;
+    o.body = body;
+    o.done = std::move(done);
+    o.queued = registry ? micros() : 0;
+    o.trace = trace;
+
+    {
+      std::unique_lock<std::mutex> lock(outgoingMutex);
+      outgoingSpace.wait(lock, [this]() { return outstanding < window || !draining; });
+      if (!draining) {
+        err.context = "Queueing";
+        err.type = BROKER_CLOSED_ERROR;
+        return err;
+      }
+
+      outgoing.push_back(std::move(o));
+      outstanding++;
+    }
+
+    outgoingReady.notify_one();
+    return err;
+  }
+
+  if (queue) {
+    if (!queue->push(event, body)) {
+      err.context = "Queueing";
+      err.type = BROKER_SPILL_ERROR;
+    }
+  } else {
+    amqp_bytes_t message_bytes;
+    message_bytes.len = body.size();
+    message_bytes.bytes = const_cast<char *>(body.data());
+
+    // Batches are also flushed from the batching thread.
+    std::lock_guard<std::mutex> lock(sendMutex);
+    err = send(event, message_bytes, trace);
+  }
+
+  if (done) {
+    done(err);
   }
 
   return err;
 }
 
+Error Publisher::flush(const std::string &event, Batch *b) {
+  std::string body(BATCH_PREFIX, sizeof(BATCH_PREFIX));
+  body.reserve(sizeof(BATCH_PREFIX) + 5 + b->body.size());
+
+  char count[4] = {
+    static_cast<char>(b->count >> 24), static_cast<char>(b->count >> 16), static_cast<char>(b->count >> 8), static_cast<char>(b->count)
+  };
+  body.append(count, sizeof(count));
+  body.append(b->body);
+  body.push_back(NIL_EXT);
+
+  std::function<void(Error)> done;
+  if (!b->done.empty()) {
+    std::vector<std::function<void(Error)>> callbacks = std::move(b->done);
+    done = [callbacks](Error err) {
+      for (auto &callback : callbacks) {
+        callback(err);
+      }
+    };
+  }
+
+  return emit(event, body, std::move(done), b->trace);
+}
+
+bool Publisher::batch(size_t bytes, int delay, std::set<std::string> e) {
+  if (batchBytes > 0 || bytes == 0) {
+    return false;
+  }
+
+  batchBytes = bytes;
+  batchDelay = std::max(delay, 0);
+  batchEvents = e;
+  batching = true;
+  batcher = std::thread([this]() {
+    collect();
+  });
+
+  return true;
+}
+
+void Publisher::collect() {
+  std::unique_lock<std::mutex> lock(batchMutex);
+
+  while (true) {
+    int64_t now = micros();
+    int64_t next = 0;
+    std::vector<std::pair<std::string, Batch>> due;
+
+    for (auto &it : batches) {
+      if (it.second.count == 0) {
+        continue;
+      }
+
+      if (!batching || it.second.deadline <= now) {
+        due.push_back(std::make_pair(it.first, std::move(it.second)));
+        it.second = Batch();
+      } else if (next == 0 || it.second.deadline < next) {
+        next = it.second.deadline;
+      }
+    }
+
+    if (!due.empty()) {
+      lock.unlock();
+      for (auto &it : due) {
+        flush(it.first, &it.second);
+      }
+      lock.lock();
+      continue;
+    }
+
+    if (!batching) {
+      return;
+    }
+
+    if (next == 0) {
+      batchReady.wait(lock);
+    } else {
+      batchReady.wait_for(lock, std::chrono::microseconds(next - now));
+    }
+  }
+}
+
 Error Consumer::connect(std::string hostname, int port, std::string group, std::vector<std::string> events) {
   Error e;
+  this->group = group;
+
+  trackMetrics();
   std::thread([hostname, port, group, events, this]() -> void {
     Error e;
 
@@ -219,8 +1003,9 @@ Error Consumer::connect(std::string hostname, int port, std::string group, std::
       }
     }
 
-    for (size_t i = 0; i < events.size(); ++i) {
-      amqp_queue_bind(conn, 1, queuename, amqp_cstring_bytes(group.c_str()), amqp_cstring_bytes(events[i].c_str()), amqp_empty_table);
+    std::vector<std::string> keys = bindings(events);
+    for (size_t i = 0; i < keys.size(); ++i) {
+      amqp_queue_bind(conn, 1, queuename, amqp_cstring_bytes(group.c_str()), amqp_cstring_bytes(keys[i].c_str()), amqp_empty_table);
       reply = amqp_get_rpc_reply(conn);
       if (reply.reply_type != AMQP_RESPONSE_NORMAL) {
         e.context = "Binding queue";
@@ -233,11 +1018,13 @@ Error Consumer::connect(std::string hostname, int port, std::string group, std::
 
         return;
       }
+    }
 
-      amqp_basic_consume(conn, 1, queuename, amqp_empty_bytes, 0, 1, 0, amqp_empty_table);
+    if (prefetch > 0) {
+      amqp_basic_qos(conn, 1, 0, prefetch, 0);
       reply = amqp_get_rpc_reply(conn);
       if (reply.reply_type != AMQP_RESPONSE_NORMAL) {
-        e.context = "Consuming";
+        e.context = "Setting prefetch";
         e.type = BROKER_RPC_ERROR;
         e.reply = reply;
 
@@ -245,17 +1032,52 @@ Error Consumer::connect(std::string hostname, int port, std::string group, std::
           errorHandler(e);
         }
 
-        return;
+        return;
+      }
+    }
+
+    // Delivery tags start over on the new channel, so whatever was settled on the last one is forgotten.
+    {
+      std::lock_guard<std::mutex> lock(ackMutex);
+      generation++;
+      settled.clear();
+      nacks.clear();
+      settledTag = 0;
+      ackTag = 0;
+      ackedTag = 0;
+    }
+
+    amqp_basic_consume(conn, 1, queuename, amqp_empty_bytes, 0, prefetch > 0 ? 0 : 1, 0, amqp_empty_table);
+    reply = amqp_get_rpc_reply(conn);
+    if (reply.reply_type != AMQP_RESPONSE_NORMAL) {
+      e.context = "Consuming";
+      e.type = BROKER_RPC_ERROR;
+      e.reply = reply;
+
+      if (errorHandler) {
+        errorHandler(e);
       }
+
+      return;
     }
 
     amqp_frame_t frame;
 
+    // With manual acks the wait is bounded, so settled messages are acknowledged even while nothing comes in.
+    struct timeval interval;
+    interval.tv_sec = ackInterval / 1000;
+    interval.tv_usec = (ackInterval % 1000) * 1000;
+
     while (open) {
       amqp_envelope_t envelope;
 
+      if (prefetch > 0 && !flushAcks(conn, false)) {
+        break;
+      }
+
       amqp_maybe_release_buffers(conn);
-      amqp_rpc_reply_t ret = amqp_consume_message(conn, &envelope, nullptr, 0);
+      struct timeval timeout = interval;
+      amqp_rpc_reply_t ret = amqp_consume_message(conn, &envelope, prefetch > 0 ? &timeout : nullptr, 0);
 
       if (AMQP_RESPONSE_NORMAL != ret.reply_type) {
         if (AMQP_RESPONSE_LIBRARY_EXCEPTION == ret.reply_type &&
@@ -280,7 +1102,8 @@ Error Consumer::connect(std::string hostname, int port, std::string group, std::
                 break;
               }
 
-              handleMessage(envelope.routing_key, message);
+              handleMessage(std::string(static_cast<char *>(envelope.routing_key.bytes), envelope.routing_key.len),
+                static_cast<const char *>(message.body.bytes), message.body.len, 0, traceFrom(message.properties));
 
               amqp_destroy_message(&message);
             } else if (frame.payload.method.id == AMQP_CHANNEL_CLOSE_METHOD) {
@@ -310,10 +1133,17 @@ Error Consumer::connect(std::string hostname, int port, std::string group, std::
         }
 
       } else {
-        handleMessage(envelope.routing_key, envelope.message);
+        handleMessage(std::string(static_cast<char *>(envelope.routing_key.bytes), envelope.routing_key.len),
+          static_cast<const char *>(envelope.message.body.bytes), envelope.message.body.len, prefetch > 0 ? envelope.delivery_tag : 0,
+          traceFrom(envelope.message.properties));
+        amqp_destroy_envelope(&envelope);
       }
     }
 
+    if (prefetch > 0) {
+      flushAcks(conn, true);
+    }
+
     reply = amqp_channel_close(conn, 1, AMQP_REPLY_SUCCESS);
     if (reply.reply_type != AMQP_RESPONSE_NORMAL) {
       e.context = "Closing channel";
@@ -359,6 +1189,252 @@ Error Consumer::connect(std::string hostname, int port, std::string group, std::
   return e;
 }
 
+PublisherPool::PublisherPool(size_t connections, size_t channels_) : channels(std::max(channels_, static_cast<size_t>(1))) {
+  for (size_t i = 0; i < std::max(connections, static_cast<size_t>(1)); i++) {
+    links.emplace_back(new Link());
+  }
+}
+
+PublisherPool::~PublisherPool() {
+  running = false;
+  for (auto &link : links) {
+    {
+      std::lock_guard<std::mutex> lock(link->mutex);
+    }
+
+    link->wake.notify_one();
+    if (link->thread.joinable()) {
+      link->thread.join();
+    }
+
+    if (link->conn) {
+      for (size_t channel = 1; channel <= channels; channel++) {
+        amqp_channel_close(link->conn, channel, AMQP_REPLY_SUCCESS);
+      }
+
+      amqp_connection_close(link->conn, AMQP_REPLY_SUCCESS);
+      amqp_destroy_connection(link->conn);
+    }
+  }
+}
+
+Error PublisherPool::connect(std::string h, int p, std::string g, std::set<std::string> s) {
+  Error e;
+  if (running) {
+    return e;
+  }
+
+  hostname = h;
+  port = p;
+  group = g;
+  events = s;
+  useMetrics(registry);
+
+  for (size_t i = 0; i < links.size(); i++) {
+    e = login(&links[i]->conn, hostname, port, group, channels, false);
+    if (e.type != BROKER_OK) {
+      for (size_t j = 0; j < i; j++) {
+        amqp_destroy_connection(links[j]->conn);
+        links[j]->conn = nullptr;
+      }
+
+      return e;
+    }
+  }
+
+  running = true;
+  for (auto &link : links) {
+    Link *l = link.get();
+    l->thread = std::thread([this, l]() {
+      run(l);
+    });
+  }
+
+  return e;
+}
+
+void PublisherPool::useMetrics(metrics::Registry *r) {
+  registry = r;
+  errorMetric = nullptr;
+  latencyMetric = nullptr;
+
+  if (registry) {
+    metrics::Labels labels = {{"exchange", group}};
+    errorMetric = &registry->counter("spectacles_broker_publish_errors_total", "Messages that failed to publish.", labels);
+    latencyMetric = &registry->summary("spectacles_broker_publish_seconds", "Time spent publishing a message.", labels);
+  }
+}
+
+Error PublisherPool::publish(const gateway::PacketView &p) {
+  return publish(p, nextKey++);
+}
+
+Error PublisherPool::publish(const gateway::PacketView &p, uint64_t key) {
+  Error err;
+  if (p.op != 0) {
+    return err;
+  }
+
+  if (events.size() != 0 && events.count(p.t) == 0) {
+    return err;
+  }
+
+  Link *link = links[key % links.size()].get();
+
+  Message m;
+  encode(p, &m.body);
+  m.key = partitions > 0 ? routingKey(p.t, m.body, partitions) : p.t;
+  m.trace = traceOf(p);
+  m.channel = static_cast<uint16_t>(1 + (key / links.size()) % channels);
+  m.queued = registry ? micros() : 0;
+
+  queued++;
+  link->queue.push(std::move(m));
+
+  // Pairs with the fence in run(), so either the thread sees the message or this sees the thread asleep.
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  if (link->asleep) {
+    std::lock_guard<std::mutex> lock(link->mutex);
+    link->wake.notify_one();
+  }
+
+  return err;
+}
+
+void PublisherPool::partition(int32_t p) {
+  partitions = p;
+}
+
+size_t PublisherPool::pending() const {
+  return queued.load();
+}
+
+bool PublisherPool::send(Link *link, const Message &m) {
+  amqp_bytes_t body;
+  body.len = m.body.size();
+  body.bytes = const_cast<char *>(m.body.data());
+
+  amqp_basic_properties_t props;
+  amqp_table_entry_t headers[3];
+  int status = amqp_basic_publish(link->conn, m.channel, amqp_cstring_bytes(group.c_str()), amqp_cstring_bytes(m.key.c_str()), 0, 0,
+    traceProperties(m.trace, &props, headers), body);
+  if (status != AMQP_STATUS_OK) {
+    if (registry) {
+      errorMetric->add();
+    }
+
+    return false;
+  }
+
+  queued--;
+
+  if (registry) {
+    latencyMetric->record(micros() - m.queued);
+
+    auto it = link->eventMetrics.find(m.key);
+    if (it == link->eventMetrics.end()) {
+      metrics::Labels labels = {{"exchange", group}, {"event", partitions > 0 ? eventOf(m.key) : m.key}};
+      metrics::Counter *messages = &registry->counter("spectacles_broker_published_total", "Messages published to the broker.", labels);
+      metrics::Counter *bytes = &registry->counter("spectacles_broker_published_bytes_total", "Bytes published to the broker.", labels);
+      it = link->eventMetrics.insert(std::make_pair(m.key, std::make_pair(messages, bytes))).first;
+    }
+
+    it->second.first->add();
+    it->second.second->add(m.body.size());
+  }
+
+  return true;
+}
+
+void PublisherPool::run(Link *link) {
+  int backoff = 100;
+  bool holding = false;
+  Message m;
+
+  auto wait = [this](int ms) {
+    for (int waited = 0; waited < ms && running; waited += 100) {
+      std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    }
+  };
+
+  while (running) {
+    if (!link->conn) {
+      Error e = login(&link->conn, hostname, port, group, channels, false);
+      if (e.type != BROKER_OK) {
+        wait(backoff);
+        backoff = std::min(backoff * 2, 10000);
+        continue;
+      }
+
+      backoff = 100;
+    }
+
+    if (!holding) {
+      if (!link->queue.pop(&m)) {
+        std::unique_lock<std::mutex> lock(link->mutex);
+        link->asleep = true;
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (running && link->queue.empty()) {
+          link->wake.wait_for(lock, std::chrono::milliseconds(100));
+        }
+
+        link->asleep = false;
+        continue;
+      }
+
+      holding = true;
+    }
+
+    if (send(link, m)) {
+      holding = false;
+    } else {
+      // Keep the message and publish it first once reconnected, so the order on its channel is kept.
+      amqp_destroy_connection(link->conn);
+      link->conn = nullptr;
+      wait(backoff);
+      backoff = std::min(backoff * 2, 10000);
+    }
+  }
+
+  if (!link->conn) {
+    return;
+  }
+
+  if (holding && !send(link, m)) {
+    return;
+  }
+
+  while (link->queue.pop(&m)) {
+    if (!send(link, m)) {
+      return;
+    }
+  }
+}
+
+Error Consumer::consume(Transport *transport, std::vector<std::string> events) {
+  Error e;
+
+  std::shared_ptr<Subscription> subscription(transport->subscribe(bindings(events)));
+  if (!subscription) {
+    e.context = "Subscribing";
+    e.type = BROKER_TRANSPORT_ERROR;
+    return e;
+  }
+
+  trackMetrics();
+
+  std::thread([subscription, this]() -> void {
+    Envelope envelope;
+    while (open) {
+      if (subscription->next(&envelope, 100)) {
+        handleMessage(envelope.key, envelope.body, envelope.length, 0, Trace());
+      }
+    }
+  }).detach();
+
+  return e;
+}
+
 Consumer::~Consumer() {
   open = false;
 }
@@ -367,31 +1443,355 @@ void Consumer::onMessage(std::function<void(std::string, gateway::Packet)> handl
   messageHandler = handler;
 }
 
+void Consumer::onMessage(std::function<void(const std::string &, const gateway::PacketView &)> handler) {
+  viewHandler = handler;
+}
+
+void Consumer::onMessage(std::function<void(const std::string &, const gateway::PacketView &, Delivery)> handler) {
+  deliveryHandler = handler;
+}
+
+void Consumer::acknowledge(uint16_t p, size_t batch, int interval) {
+  prefetch = p;
+  ackBatch = std::max(batch, static_cast<size_t>(1));
+  ackInterval = std::max(interval, 1);
+}
+
+void Consumer::settle(uint64_t tag, uint64_t g, bool ack, bool requeue) {
+  if (tag == 0) {
+    return;
+  }
+
+  std::lock_guard<std::mutex> lock(ackMutex);
+  if (g != generation) {
+    return;
+  }
+
+  settled[tag] = ack;
+  if (!ack) {
+    nacks.push_back(std::make_pair(tag, requeue));
+  }
+}
+
+// Delivery tags on a channel count up from 1, so every acked message up to the first unsettled tag can be
+// acknowledged at once. Nacks go out first and the cumulative ack stops at the last acked tag, as it must not be the
+// one to settle a rejected message.
+bool Consumer::flushAcks(amqp_connection_state_t conn, bool force) {
+  std::vector<std::pair<uint64_t, bool>> rejected;
+  uint64_t tag = 0;
+  {
+    std::lock_guard<std::mutex> lock(ackMutex);
+    rejected.swap(nacks);
+    while (!settled.empty() && settled.begin()->first == settledTag + 1) {
+      settledTag++;
+      if (settled.begin()->second) {
+        ackTag = settledTag;
+      }
+
+      settled.erase(settled.begin());
+    }
+
+    int64_t now = micros();
+    if (ackTag > ackedTag && (force || ackTag - ackedTag >= ackBatch || now - lastAck >= ackInterval * 1000)) {
+      tag = ackTag;
+      ackedTag = ackTag;
+      lastAck = now;
+    }
+  }
+
+  for (auto &nack : rejected) {
+    if (amqp_basic_nack(conn, 1, nack.first, 0, nack.second) != AMQP_STATUS_OK) {
+      return false;
+    }
+  }
+
+  return tag == 0 || amqp_basic_ack(conn, 1, tag, 1) == AMQP_STATUS_OK;
+}
+
+void Delivery::ack() const {
+  if (!consumer) {
+    return;
+  }
+
+  if (!parts) {
+    consumer->settle(tag, generation, true, false);
+  } else if (parts->remaining.fetch_sub(1) == 1) {
+    consumer->settle(tag, generation, !parts->rejected, parts->requeue);
+  }
+}
+
+void Delivery::nack(bool requeue) const {
+  if (!consumer) {
+    return;
+  }
+
+  if (!parts) {
+    consumer->settle(tag, generation, false, requeue);
+    return;
+  }
+
+  if (requeue) {
+    parts->requeue = true;
+  }
+
+  parts->rejected = true;
+  if (parts->remaining.fetch_sub(1) == 1) {
+    consumer->settle(tag, generation, false, parts->requeue);
+  }
+}
+
+void Consumer::useMetrics(metrics::Registry *r) {
+  registry = r;
+}
+
+void Consumer::trackMetrics() {
+  if (!registry) {
+    return;
+  }
+
+  metrics::Labels labels = {{"exchange", group}};
+  decodeMetric = &registry->summary("spectacles_broker_decode_seconds", "Time spent decoding consumed messages.", labels);
+  inflateMetric = &registry->summary("spectacles_broker_decompress_seconds", "Time spent decompressing consumed messages.", labels);
+  inflateInMetric = &registry->counter("spectacles_broker_decompress_input_bytes_total", "Bytes of consumed messages before decompression.", labels);
+  inflateOutMetric = &registry->counter("spectacles_broker_decompress_output_bytes_total", "Bytes of consumed messages after decompression.", labels);
+}
+
+void Consumer::count(const std::string &event, size_t bytes) {
+  auto it = eventMetrics.find(event);
+  if (it == eventMetrics.end()) {
+    metrics::Labels labels = {{"exchange", group}, {"event", event}};
+    metrics::Counter *messages = &registry->counter("spectacles_broker_consumed_total", "Messages consumed from the broker.", labels);
+    metrics::Counter *b = &registry->counter("spectacles_broker_consumed_bytes_total", "Bytes consumed from the broker.", labels);
+    it = eventMetrics.insert(std::make_pair(event, std::make_pair(messages, b))).first;
+  }
+
+  it->second.first->add();
+  it->second.second->add(bytes);
+}
+
 void Consumer::onError(std::function<void(Error)> handler) {
   errorHandler = handler;
 }
 
-void Consumer::handleMessage(amqp_bytes_t routing_key, amqp_message_t message) {
-  if (messageHandler) {
-    etf::Decoder decoder(static_cast<uint8_t *>(message.body.bytes), message.body.len);
-    etf::Data d = decoder.unpack();
+void Consumer::useDispatchPool(DispatchPool *p, order_key o) {
+  pool = p;
+  order = o;
+}
 
-    gateway::Packet p;
-    p.op = d["op"];
-    p.d = d["d"];
-    p.length = message.body.len;
+void Consumer::partition(int32_t p, int32_t first, int32_t last) {
+  partitions = p;
+  firstPartition = std::max(first, 0);
+  lastPartition = last < 0 || last >= p ? p - 1 : last;
+}
+
+std::vector<std::string> Consumer::bindings(const std::vector<std::string> &events) const {
+  if (partitions <= 0) {
+    return events;
+  }
+
+  std::vector<std::string> keys;
+  for (const std::string &event : events) {
+    for (int32_t i = firstPartition; i <= lastPartition; i++) {
+      keys.push_back(event + "." + std::to_string(i));
+    }
+  }
+
+  return keys;
+}
+
+void Consumer::handleMessage(const std::string &key, const char *body, size_t length, uint64_t tag, const Trace &trace) {
+  // Handlers are given the event name, not the partition it was routed through.
+  std::string stripped;
+  if (partitions > 0) {
+    stripped = eventOf(key);
+  }
+
+  const std::string &event = partitions > 0 ? stripped : key;
 
-    p.raw = static_cast<char *>(malloc(message.body.len * sizeof(char)));
-    memcpy(p.raw, message.body.bytes, message.body.len);
+  if (registry) {
+    count(event, length);
+  }
+
+  uint64_t g = generation;
+  if (!messageHandler && !viewHandler && !deliveryHandler) {
+    settle(tag, g, true, false);
+    return;
+  }
+
+  // Compressed bodies are inflated into a buffer that is reused for every message.
+  if (length > 6 && static_cast<uint8_t>(body[0]) == FORMAT_VERSION && body[1] == COMPRESSED) {
+    int64_t start = inflateMetric ? micros() : 0;
+    if (!inflateTerm(body, length, &inflated)) {
+      settle(tag, g, false, false);
+      return;
+    }
+
+    if (inflateMetric) {
+      inflateMetric->record(micros() - start);
+      inflateInMetric->add(length);
+      inflateOutMetric->add(inflated.size());
+    }
+
+    body = inflated.data();
+    length = inflated.size();
+  }
+
+  if (length < sizeof(BATCH_PREFIX) || memcmp(body, BATCH_PREFIX, sizeof(BATCH_PREFIX)) != 0) {
+    dispatch(event, body, length, Delivery(this, tag, g), trace);
+    return;
+  }
+
+  // Every event of a batch is handled on its own, and the message is settled once all of them are.
+  etf::Scanner list(body + sizeof(BATCH_PREFIX) - 1, length - sizeof(BATCH_PREFIX) + 1, true);
+  std::vector<etf::Slice> elements;
+
+  // The length comes off the wire, so elements are only kept as they are actually read.
+  uint32_t n = 0;
+  etf::Slice slice;
+  if (list.listHeader(&n)) {
+    for (uint32_t k = 0; k < n && list.term(&slice); k++) {
+      elements.push_back(slice);
+    }
+  }
+
+  // A batch that cannot be read would fail the same way again, so it is rejected for good.
+  if (!list.good() || elements.size() != n) {
+    settle(tag, g, false, false);
+    return;
+  }
+
+  if (elements.empty()) {
+    settle(tag, g, true, false);
+    return;
+  }
+
+  std::shared_ptr<Delivery::Parts> parts = std::make_shared<Delivery::Parts>(elements.size());
+  std::string element;
+  for (const etf::Slice &slice : elements) {
+    element.assign(1, static_cast<char>(FORMAT_VERSION));
+    element.append(slice.data, slice.length);
+
+    dispatch(event, element.data(), element.size(), Delivery(this, tag, g, parts), trace);
+  }
+}
+
+void Consumer::dispatch(const std::string &event, const char *body, size_t length, Delivery delivery, const Trace &trace) {
+  if (!pool) {
+    deliver(event, body, length, delivery, trace);
+    return;
+  }
+
+  uint64_t key = 0;
+  if (order == ORDER_BY_GUILD) {
+    // Published messages hold just the event data, but whole payloads are looked into as well.
+    etf::Header header;
+    etf::Scanner payload(body, length);
+    if (payload.header(&header) && !header.d.empty()) {
+      etf::Scanner d(header.d.data, header.d.length, true);
+      if (d.find("guild_id")) {
+        d.snowflake(&key);
+      }
+    } else {
+      etf::Scanner d(body, length);
+      if (d.find("guild_id")) {
+        d.snowflake(&key);
+      }
+    }
+  } else {
+    key = std::hash<std::string>()(event);
+  }
+
+  // The frame buffer is reused as soon as handleMessage returns, so the task gets a copy of its own.
+  Buffer copy(body, length);
+  pool->submit(key, [this, event, copy, delivery, trace]() {
+    deliver(event, copy.data(), copy.size(), delivery, trace);
+  });
+}
+
+void Consumer::decodeLazily(bool l) {
+  lazy = l;
+}
+
+void Consumer::measure(const std::string &event, const Trace &trace) {
+  Histogram *latency;
+  {
+    std::lock_guard<std::mutex> lock(latencyMutex);
+    Histogram *&h = latencyMetrics[event];
+    if (!h) {
+      h = &registry->summary("spectacles_broker_event_latency_seconds", "Time from the gateway receiving an event to its consumer handlers being called.", {{"exchange", group}, {"event", event}});
+    }
+
+    latency = h;
+  }
+
+  // Clocks of different hosts can be slightly apart, which is no reason to report a negative latency.
+  latency->record(std::max<int64_t>(wallMicros() - trace.received, 0));
+}
+
+void Consumer::deliver(const std::string &event, const char *body, size_t length, Delivery delivery, const Trace &trace) {
+  gateway::PacketView view(body, length);
+  etf::Data d;
+
+  etf::Header header;
+  if (lazy && etf::Scanner(body, length).header(&header)) {
+    view.op = header.op < 0 ? 0 : header.op;
+    if (view.op == 0) {
+      view.t = header.t.str();
+      view.s = header.s;
+    }
+  } else {
+    int64_t start = decodeMetric ? micros() : 0;
+
+    etf::Decoder decoder(reinterpret_cast<const uint8_t *>(body), length);
+    d = decoder.unpack();
+
+    if (decodeMetric) {
+      decodeMetric->record(micros() - start);
+    }
 
-    int op = d["op"];
-    if (op == 0) {
-      std::string t = d["t"];
-      p.t = t;
-      p.s = d["s"];
+    view = gateway::PacketView(&d["d"], body, length);
+    view.op = d["op"];
+    if (view.op == 0) {
+      std::string name = d["t"];
+      view.t = name;
+      view.s = d["s"];
     }
+  }
+
+  view.received = trace.received;
+  view.shard = trace.shard;
+
+  if (registry && trace.received != 0) {
+    measure(event, trace);
+  }
+
+  if (viewHandler) {
+    viewHandler(event, view);
+  }
+
+  if (deliveryHandler) {
+    deliveryHandler(event, view, delivery);
+  }
+
+  if (messageHandler) {
+    gateway::Packet p;
+    p.op = view.op;
+    p.d = std::move(view.data());
+    p.t = view.t;
+    p.s = view.s;
+    p.length = length;
+    p.received = view.received;
+    p.shard = view.shard;
+
+    p.raw = static_cast<char *>(malloc(length * sizeof(char)));
+    memcpy(p.raw, body, length);
+
+    messageHandler(event, std::move(p));
+  }
 
-    messageHandler(std::string(static_cast<char *>(routing_key.bytes), routing_key.len), p);
+  // A delivery handler settles through its handle; otherwise the message is done once the handlers return.
+  if (!deliveryHandler) {
+    delivery.ack();
   }
 }
 
@@ -0,0 +1,877 @@
+#include <string>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cstring>
+
+#include "../include/cache.h"
+
+namespace spectacles {
+
+namespace cache {
+
+static bool boolean(etf::Scanner *s, bool *out) {
+  etf::Slice atom;
+  if (!s->string(&atom)) {
+    return false;
+  }
+
+  *out = atom.equals("true");
+  return true;
+}
+
+// Truncates on a character boundary, so a cut name is still valid UTF-8.
+static void name(const etf::Slice &value, char *out, uint8_t *length, size_t capacity) {
+  size_t n = value.length;
+  if (n > capacity) {
+    n = capacity;
+    while (n > 0 && (static_cast<uint8_t>(value.data[n]) & 0xC0) == 0x80) {
+      n--;
+    }
+  }
+
+  memcpy(out, value.data, n);
+  *length = static_cast<uint8_t>(n);
+}
+
+static int digits(const char *data, int n) {
+  int value = 0;
+  for (int i = 0; i < n; i++) {
+    value = value * 10 + (data[i] - '0');
+  }
+
+  return value;
+}
+
+// Reads the seconds of an ISO 8601 timestamp such as 2015-04-26T06:26:56.936000+00:00, which Discord always sends in UTC.
+static uint32_t timestamp(const etf::Slice &value) {
+  if (value.length < 19) {
+    return 0;
+  }
+
+  int year = digits(value.data, 4);
+  int month = digits(value.data + 5, 2);
+  int day = digits(value.data + 8, 2);
+
+  // Days from civil, counting years from March so leap days come last.
+  year -= month <= 2;
+  int era = year / 400;
+  int yoe = year - era * 400;
+  int doy = (153 * (month + (month > 2 ? -3 : 9)) + 2) / 5 + day - 1;
+  int doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+  int64_t days = static_cast<int64_t>(era) * 146097 + doe - 719468;
+
+  return static_cast<uint32_t>(days * 86400 + digits(value.data + 11, 2) * 3600 + digits(value.data + 14, 2) * 60
+      + digits(value.data + 17, 2));
+}
+
+// Reads the ID out of an object such as a user, skipping the rest of it.
+static bool nestedId(etf::Scanner *s, uint64_t *id) {
+  etf::Slice object;
+  if (!s->term(&object)) {
+    return false;
+  }
+
+  etf::Scanner o(object.data, object.length, true);
+  return o.find("id") && o.snowflake(id);
+}
+
+void Store::readChannel(etf::Scanner *s, uint64_t guildId) {
+  uint32_t arity;
+  if (!s->mapHeader(&arity)) {
+    return;
+  }
+
+  uint64_t id = 0;
+  Channel c;
+  memset(static_cast<void *>(&c), 0, sizeof(c));
+  c.guild_id = guildId;
+
+  for (uint32_t i = 0; i < arity && s->good(); i++) {
+    etf::Slice key;
+    if (!s->string(&key)) {
+      return;
+    }
+
+    int64_t n;
+    bool b;
+    etf::Slice value;
+    if (key.equals("id")) {
+      s->snowflake(&id);
+    } else if (key.equals("guild_id")) {
+      if (!s->nil()) {
+        s->snowflake(&c.guild_id);
+      }
+    } else if (key.equals("parent_id")) {
+      if (!s->nil()) {
+        s->snowflake(&c.parent_id);
+      }
+    } else if (key.equals("position") && s->integer(&n)) {
+      c.position = static_cast<int32_t>(n);
+    } else if (key.equals("type") && s->integer(&n)) {
+      c.type = static_cast<uint8_t>(n);
+    } else if (key.equals("nsfw") && boolean(s, &b)) {
+      c.flags |= b ? CHANNEL_NSFW : 0;
+    } else if (key.equals("name")) {
+      if (!s->nil()) {
+        if (s->string(&value)) {
+          name(value, c.name, &c.name_length, sizeof(c.name));
+        } else {
+          s->skip();
+        }
+      }
+    } else {
+      s->skip();
+    }
+  }
+
+  // Direct message channels are not cached.
+  if (s->good() && id != 0 && c.guild_id != 0) {
+    putChannel(id, c);
+  }
+}
+
+void Store::readRole(etf::Scanner *s, uint64_t guildId) {
+  uint32_t arity;
+  if (!s->mapHeader(&arity)) {
+    return;
+  }
+
+  uint64_t id = 0;
+  Role r;
+  memset(static_cast<void *>(&r), 0, sizeof(r));
+  r.guild_id = guildId;
+
+  for (uint32_t i = 0; i < arity && s->good(); i++) {
+    etf::Slice key;
+    if (!s->string(&key)) {
+      return;
+    }
+
+    int64_t n;
+    bool b;
+    etf::Slice value;
+    if (key.equals("id")) {
+      s->snowflake(&id);
+    } else if (key.equals("permissions")) {
+      s->snowflake(&r.permissions);
+    } else if (key.equals("color") && s->integer(&n)) {
+      r.color = static_cast<uint32_t>(n);
+    } else if (key.equals("position") && s->integer(&n)) {
+      r.position = static_cast<int16_t>(n);
+    } else if (key.equals("hoist") && boolean(s, &b)) {
+      r.flags |= b ? ROLE_HOIST : 0;
+    } else if (key.equals("managed") && boolean(s, &b)) {
+      r.flags |= b ? ROLE_MANAGED : 0;
+    } else if (key.equals("mentionable") && boolean(s, &b)) {
+      r.flags |= b ? ROLE_MENTIONABLE : 0;
+    } else if (key.equals("name") && s->string(&value)) {
+      name(value, r.name, &r.name_length, sizeof(r.name));
+    } else {
+      s->skip();
+    }
+  }
+
+  if (s->good() && id != 0 && guildId != 0) {
+    putRole(id, r);
+  }
+}
+
+void Store::readMember(etf::Scanner *s, uint64_t guildId, bool add) {
+  uint32_t arity;
+  if (!s->mapHeader(&arity)) {
+    return;
+  }
+
+  uint64_t user = 0;
+  Member m;
+  memset(static_cast<void *>(&m), 0, sizeof(m));
+
+  for (uint32_t i = 0; i < arity && s->good(); i++) {
+    etf::Slice key;
+    if (!s->string(&key)) {
+      return;
+    }
+
+    bool b;
+    etf::Slice value;
+    if (key.equals("user")) {
+      nestedId(s, &user);
+    } else if (key.equals("guild_id")) {
+      s->snowflake(&guildId);
+    } else if (key.equals("joined_at") && s->string(&value)) {
+      m.joined_at = timestamp(value);
+    } else if (key.equals("deaf") && boolean(s, &b)) {
+      m.flags |= b ? MEMBER_DEAF : 0;
+    } else if (key.equals("mute") && boolean(s, &b)) {
+      m.flags |= b ? MEMBER_MUTE : 0;
+    } else if (key.equals("nick")) {
+      if (!s->nil()) {
+        m.flags |= MEMBER_NICK;
+        s->skip();
+      }
+    } else if (key.equals("roles")) {
+      uint32_t length;
+      if (!s->listHeader(&length)) {
+        return;
+      }
+
+      for (uint32_t j = 0; j < length && s->good(); j++) {
+        uint64_t role;
+        if (!s->snowflake(&role)) {
+          return;
+        }
+
+        if (m.role_count < Member::ROLES) {
+          m.roles[m.role_count++] = role;
+        } else {
+          m.flags |= MEMBER_ROLES_TRUNCATED;
+        }
+      }
+
+      // A non-empty list ends with a tail.
+      if (length > 0) {
+        s->skip();
+      }
+    } else {
+      s->skip();
+    }
+  }
+
+  if (!s->good() || user == 0 || guildId == 0) {
+    return;
+  }
+
+  // Members are only counted as they join, GUILD_CREATE and chunks carry the count along.
+  Guild g;
+  if (add && guild(guildId, &g)) {
+    g.member_count++;
+    putGuild(guildId, g);
+  }
+
+  putMember(guildId, user, m);
+}
+
+void Store::readGuild(etf::Scanner *s, bool create) {
+  uint32_t arity;
+  if (!s->mapHeader(&arity)) {
+    return;
+  }
+
+  uint64_t id = 0;
+  Guild parsed;
+  memset(static_cast<void *>(&parsed), 0, sizeof(parsed));
+  bool hasCount = false, hasName = false, hasOwner = false;
+  etf::Slice channels, roles, members;
+
+  for (uint32_t i = 0; i < arity && s->good(); i++) {
+    etf::Slice key;
+    if (!s->string(&key)) {
+      return;
+    }
+
+    int64_t n;
+    bool b;
+    etf::Slice value;
+    if (key.equals("id")) {
+      s->snowflake(&id);
+    } else if (key.equals("owner_id")) {
+      hasOwner = s->snowflake(&parsed.owner_id);
+    } else if (key.equals("member_count") && s->integer(&n)) {
+      parsed.member_count = static_cast<uint32_t>(n);
+      hasCount = true;
+    } else if (key.equals("unavailable") && boolean(s, &b)) {
+      parsed.flags |= b ? GUILD_UNAVAILABLE : 0;
+    } else if (key.equals("large") && boolean(s, &b)) {
+      parsed.flags |= b ? GUILD_LARGE : 0;
+    } else if (key.equals("name") && s->string(&value)) {
+      name(value, parsed.name, &parsed.name_length, sizeof(parsed.name));
+      hasName = true;
+    } else if (key.equals("channels")) {
+      s->term(&channels);
+    } else if (key.equals("roles")) {
+      s->term(&roles);
+    } else if (key.equals("members")) {
+      s->term(&members);
+    } else {
+      s->skip();
+    }
+  }
+
+  if (!s->good() || id == 0) {
+    return;
+  }
+
+  // Updates leave out the member count and may leave out other fields.
+  Guild g;
+  if (create || !guild(id, &g)) {
+    g = parsed;
+  } else {
+    g.flags = parsed.flags | (g.flags & GUILD_LARGE);
+    if (hasOwner) {
+      g.owner_id = parsed.owner_id;
+    }
+
+    if (hasCount) {
+      g.member_count = parsed.member_count;
+    }
+
+    if (hasName) {
+      memcpy(g.name, parsed.name, sizeof(g.name));
+      g.name_length = parsed.name_length;
+    }
+  }
+
+  putGuild(id, g);
+
+  struct List {
+    etf::Slice *slice;
+    int type;
+  } lists[] = {{&channels, 0}, {&roles, 1}, {&members, 2}};
+
+  for (const List &list : lists) {
+    if (list.slice->empty()) {
+      continue;
+    }
+
+    etf::Scanner l(list.slice->data, list.slice->length, true);
+    uint32_t length;
+    if (!l.listHeader(&length)) {
+      continue;
+    }
+
+    for (uint32_t i = 0; i < length && l.good(); i++) {
+      if (list.type == 0) {
+        readChannel(&l, id);
+      } else if (list.type == 1) {
+        readRole(&l, id);
+      } else {
+        readMember(&l, id, false);
+      }
+    }
+  }
+}
+
+void Store::guildDelete(etf::Scanner *s) {
+  uint64_t id = 0;
+  bool unavailable = false;
+
+  etf::Scanner fields = *s;
+  if (!s->find("id") || !s->snowflake(&id)) {
+    return;
+  }
+
+  if (fields.find("unavailable")) {
+    boolean(&fields, &unavailable);
+  }
+
+  // An outage keeps everything around, marked unavailable until the guild comes back.
+  Guild g;
+  if (unavailable) {
+    if (guild(id, &g)) {
+      g.flags |= GUILD_UNAVAILABLE;
+      putGuild(id, g);
+    }
+    return;
+  }
+
+  eraseGuild(id);
+  purge(id);
+}
+
+void Store::channelDelete(etf::Scanner *s) {
+  uint64_t id;
+  if (s->find("id") && s->snowflake(&id)) {
+    eraseChannel(id);
+  }
+}
+
+void Store::roleEvent(etf::Scanner *s, bool remove) {
+  uint32_t arity;
+  if (!s->mapHeader(&arity)) {
+    return;
+  }
+
+  uint64_t guildId = 0, roleId = 0;
+  etf::Slice object;
+  for (uint32_t i = 0; i < arity && s->good(); i++) {
+    etf::Slice key;
+    if (!s->string(&key)) {
+      return;
+    }
+
+    if (key.equals("guild_id")) {
+      s->snowflake(&guildId);
+    } else if (key.equals("role_id")) {
+      s->snowflake(&roleId);
+    } else if (key.equals("role")) {
+      s->term(&object);
+    } else {
+      s->skip();
+    }
+  }
+
+  if (!s->good()) {
+    return;
+  }
+
+  if (remove) {
+    eraseRole(roleId);
+  } else if (!object.empty()) {
+    etf::Scanner r(object.data, object.length, true);
+    readRole(&r, guildId);
+  }
+}
+
+void Store::memberRemove(etf::Scanner *s) {
+  uint64_t guildId = 0, user = 0;
+
+  etf::Scanner fields = *s;
+  if (!s->find("guild_id") || !s->snowflake(&guildId) || !fields.find("user") || !nestedId(&fields, &user)) {
+    return;
+  }
+
+  Guild g;
+  if (eraseMember(guildId, user) && guild(guildId, &g) && g.member_count > 0) {
+    g.member_count--;
+    putGuild(guildId, g);
+  }
+}
+
+void Store::membersChunk(etf::Scanner *s) {
+  uint64_t guildId = 0;
+
+  etf::Scanner fields = *s;
+  if (!fields.find("guild_id") || !fields.snowflake(&guildId) || !s->find("members")) {
+    return;
+  }
+
+  uint32_t length;
+  if (!s->listHeader(&length)) {
+    return;
+  }
+
+  for (uint32_t i = 0; i < length && s->good(); i++) {
+    readMember(s, guildId, false);
+  }
+}
+
+bool Store::apply(const etf::Slice &t, const etf::Slice &d) {
+  etf::Scanner s(d.data, d.length, true);
+
+  if (t.equals("GUILD_CREATE")) {
+    readGuild(&s, true);
+  } else if (t.equals("GUILD_UPDATE")) {
+    readGuild(&s, false);
+  } else if (t.equals("GUILD_DELETE")) {
+    guildDelete(&s);
+  } else if (t.equals("CHANNEL_CREATE") || t.equals("CHANNEL_UPDATE")) {
+    readChannel(&s, 0);
+  } else if (t.equals("CHANNEL_DELETE")) {
+    channelDelete(&s);
+  } else if (t.equals("GUILD_ROLE_CREATE") || t.equals("GUILD_ROLE_UPDATE")) {
+    roleEvent(&s, false);
+  } else if (t.equals("GUILD_ROLE_DELETE")) {
+    roleEvent(&s, true);
+  } else if (t.equals("GUILD_MEMBER_ADD")) {
+    readMember(&s, 0, true);
+  } else if (t.equals("GUILD_MEMBER_UPDATE")) {
+    readMember(&s, 0, false);
+  } else if (t.equals("GUILD_MEMBER_REMOVE")) {
+    memberRemove(&s);
+  } else if (t.equals("GUILD_MEMBERS_CHUNK")) {
+    membersChunk(&s);
+  } else {
+    return false;
+  }
+
+  return true;
+}
+
+bool MemoryStore::putGuild(uint64_t id, const Guild &guild) {
+  return guilds.put(id, 0, guild);
+}
+
+bool MemoryStore::putChannel(uint64_t id, const Channel &channel) {
+  return channels.put(id, 0, channel);
+}
+
+bool MemoryStore::putRole(uint64_t id, const Role &role) {
+  return roles.put(id, 0, role);
+}
+
+bool MemoryStore::putMember(uint64_t guild, uint64_t user, const Member &member) {
+  return members.put(user, guild, member);
+}
+
+bool MemoryStore::eraseGuild(uint64_t id) {
+  return guilds.erase(id, 0);
+}
+
+bool MemoryStore::eraseChannel(uint64_t id) {
+  return channels.erase(id, 0);
+}
+
+bool MemoryStore::eraseRole(uint64_t id) {
+  return roles.erase(id, 0);
+}
+
+bool MemoryStore::eraseMember(uint64_t guild, uint64_t user) {
+  return members.erase(user, guild);
+}
+
+void MemoryStore::purge(uint64_t guild) {
+  channels.eraseIf([guild](uint64_t id, uint64_t scope, const Channel &c) {
+    return c.guild_id == guild;
+  });
+
+  roles.eraseIf([guild](uint64_t id, uint64_t scope, const Role &r) {
+    return r.guild_id == guild;
+  });
+
+  members.eraseIf([guild](uint64_t id, uint64_t scope, const Member &m) {
+    return scope == guild;
+  });
+}
+
+bool MemoryStore::guild(uint64_t id, Guild *out) const {
+  return guilds.get(id, 0, out);
+}
+
+bool MemoryStore::channel(uint64_t id, Channel *out) const {
+  return channels.get(id, 0, out);
+}
+
+bool MemoryStore::role(uint64_t id, Role *out) const {
+  return roles.get(id, 0, out);
+}
+
+bool MemoryStore::member(uint64_t guild, uint64_t user, Member *out) const {
+  return members.get(user, guild, out);
+}
+
+static const uint32_t SHARED_MAGIC = 0x53505354;
+static const uint32_t SHARED_VERSION = 2;
+
+struct SharedStore::Header {
+  uint32_t magic;
+  uint32_t version;
+  uint32_t slotSizes[4];
+  uint64_t capacities[4];
+  std::atomic<uint64_t> dropped;
+  std::atomic<uint32_t> moves[4];
+};
+
+static size_t aligned(size_t n) {
+  return (n + 63) & ~static_cast<size_t>(63);
+}
+
+static bool powerOfTwo(size_t n) {
+  return n >= 2 && (n & (n - 1)) == 0;
+}
+
+// Shared tables never grow, and deleted slots only become free again by compacting. Until then every probe that
+// crosses them, which includes every miss, gets longer, so they're cleared once they take up an eighth of a table.
+// Past three quarters full a miss probes most of the table, so only entries already in it are still updated.
+template <typename T>
+static bool insert(Slots<T> *slots, uint64_t id, uint64_t scope, const T &record) {
+  if (slots->deleted() * 8 > slots->capacity()) {
+    slots->compact();
+  }
+
+  if ((slots->used() + 1) * 4 > slots->capacity() * 3 && !slots->get(id, scope, nullptr)) {
+    return false;
+  }
+
+  return slots->put(id, scope, record);
+}
+
+SharedStore::~SharedStore() {
+  drop();
+}
+
+size_t SharedStore::layout(const Capacity &capacity, size_t offsets[4]) {
+  size_t size = aligned(sizeof(Header));
+
+  offsets[0] = size;
+  size += aligned(capacity.guilds * sizeof(Slot<Guild>));
+  offsets[1] = size;
+  size += aligned(capacity.channels * sizeof(Slot<Channel>));
+  offsets[2] = size;
+  size += aligned(capacity.roles * sizeof(Slot<Role>));
+  offsets[3] = size;
+  size += aligned(capacity.members * sizeof(Slot<Member>));
+
+  return size;
+}
+
+void SharedStore::place(const Capacity &capacity) {
+  size_t offsets[4];
+  layout(capacity, offsets);
+
+  char *base = static_cast<char *>(memory);
+  std::atomic<uint32_t> *moves = static_cast<Header *>(memory)->moves;
+  guilds = Slots<Guild>(reinterpret_cast<Slot<Guild> *>(base + offsets[0]), capacity.guilds, false, &moves[0]);
+  channels = Slots<Channel>(reinterpret_cast<Slot<Channel> *>(base + offsets[1]), capacity.channels, false, &moves[1]);
+  roles = Slots<Role>(reinterpret_cast<Slot<Role> *>(base + offsets[2]), capacity.roles, false, &moves[2]);
+  members = Slots<Member>(reinterpret_cast<Slot<Member> *>(base + offsets[3]), capacity.members, false, &moves[3]);
+}
+
+void SharedStore::drop() {
+  guilds = Slots<Guild>();
+  channels = Slots<Channel>();
+  roles = Slots<Role>();
+  members = Slots<Member>();
+
+  if (memory) {
+    munmap(memory, size);
+    memory = nullptr;
+  }
+
+  if (fd != -1) {
+    close(fd);
+    fd = -1;
+  }
+
+  writable = false;
+}
+
+bool SharedStore::create(const std::string &file, const Capacity &capacity) {
+  if (fd != -1 || !powerOfTwo(capacity.guilds) || !powerOfTwo(capacity.channels) || !powerOfTwo(capacity.roles)
+      || !powerOfTwo(capacity.members)) {
+    return false;
+  }
+
+  // Readers keep their mapping of the old file, a truncated one would fault under them.
+  unlink(file.c_str());
+
+  fd = ::open(file.c_str(), O_RDWR | O_CREAT | O_EXCL, 0644);
+  if (fd == -1) {
+    return false;
+  }
+
+  size_t offsets[4];
+  size = layout(capacity, offsets);
+
+  struct stat st;
+  if (ftruncate(fd, size) != 0 || fstat(fd, &st) != 0) {
+    drop();
+    return false;
+  }
+
+  memory = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (memory == MAP_FAILED) {
+    memory = nullptr;
+    drop();
+    return false;
+  }
+
+  Header *header = static_cast<Header *>(memory);
+  header->version = SHARED_VERSION;
+  header->slotSizes[0] = sizeof(Slot<Guild>);
+  header->slotSizes[1] = sizeof(Slot<Channel>);
+  header->slotSizes[2] = sizeof(Slot<Role>);
+  header->slotSizes[3] = sizeof(Slot<Member>);
+  header->capacities[0] = capacity.guilds;
+  header->capacities[1] = capacity.channels;
+  header->capacities[2] = capacity.roles;
+  header->capacities[3] = capacity.members;
+  header->dropped.store(0);
+  for (std::atomic<uint32_t> &moves : header->moves) {
+    moves.store(0);
+  }
+
+  // Readers check the magic last, so they never see a half written header.
+  std::atomic_thread_fence(std::memory_order_release);
+  header->magic = SHARED_MAGIC;
+
+  place(capacity);
+  path = file;
+  inode = st.st_ino;
+  writable = true;
+  return true;
+}
+
+bool SharedStore::attach(const std::string &file) {
+  if (fd != -1) {
+    return false;
+  }
+
+  fd = ::open(file.c_str(), O_RDONLY);
+  if (fd == -1) {
+    return false;
+  }
+
+  struct stat st;
+  if (fstat(fd, &st) != 0 || static_cast<size_t>(st.st_size) < sizeof(Header)) {
+    drop();
+    return false;
+  }
+
+  size = st.st_size;
+  memory = mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+  if (memory == MAP_FAILED) {
+    memory = nullptr;
+    drop();
+    return false;
+  }
+
+  const Header *header = static_cast<const Header *>(memory);
+  bool valid = header->magic == SHARED_MAGIC;
+  std::atomic_thread_fence(std::memory_order_acquire);
+
+  valid = valid && header->version == SHARED_VERSION && header->slotSizes[0] == sizeof(Slot<Guild>)
+      && header->slotSizes[1] == sizeof(Slot<Channel>) && header->slotSizes[2] == sizeof(Slot<Role>)
+      && header->slotSizes[3] == sizeof(Slot<Member>);
+
+  Capacity capacity;
+  capacity.guilds = header->capacities[0];
+  capacity.channels = header->capacities[1];
+  capacity.roles = header->capacities[2];
+  capacity.members = header->capacities[3];
+
+  size_t offsets[4];
+  if (!valid || !powerOfTwo(capacity.guilds) || !powerOfTwo(capacity.channels) || !powerOfTwo(capacity.roles)
+      || !powerOfTwo(capacity.members) || layout(capacity, offsets) != size) {
+    drop();
+    return false;
+  }
+
+  place(capacity);
+  path = file;
+  inode = st.st_ino;
+  return true;
+}
+
+bool SharedStore::current() const {
+  struct stat st;
+  return memory && stat(path.c_str(), &st) == 0 && st.st_ino == inode;
+}
+
+uint64_t SharedStore::dropped() const {
+  return memory ? static_cast<const Header *>(memory)->dropped.load(std::memory_order_relaxed) : 0;
+}
+
+bool SharedStore::putGuild(uint64_t id, const Guild &guild) {
+  std::lock_guard<std::mutex> lock(guildMutex);
+  if (!writable) {
+    return false;
+  }
+
+  if (!insert(&guilds, id, 0, guild)) {
+    static_cast<Header *>(memory)->dropped.fetch_add(1, std::memory_order_relaxed);
+    return false;
+  }
+
+  return true;
+}
+
+bool SharedStore::putChannel(uint64_t id, const Channel &channel) {
+  std::lock_guard<std::mutex> lock(channelMutex);
+  if (!writable) {
+    return false;
+  }
+
+  if (!insert(&channels, id, 0, channel)) {
+    static_cast<Header *>(memory)->dropped.fetch_add(1, std::memory_order_relaxed);
+    return false;
+  }
+
+  return true;
+}
+
+bool SharedStore::putRole(uint64_t id, const Role &role) {
+  std::lock_guard<std::mutex> lock(roleMutex);
+  if (!writable) {
+    return false;
+  }
+
+  if (!insert(&roles, id, 0, role)) {
+    static_cast<Header *>(memory)->dropped.fetch_add(1, std::memory_order_relaxed);
+    return false;
+  }
+
+  return true;
+}
+
+bool SharedStore::putMember(uint64_t guild, uint64_t user, const Member &member) {
+  std::lock_guard<std::mutex> lock(memberMutex);
+  if (!writable) {
+    return false;
+  }
+
+  if (!insert(&members, user, guild, member)) {
+    static_cast<Header *>(memory)->dropped.fetch_add(1, std::memory_order_relaxed);
+    return false;
+  }
+
+  return true;
+}
+
+bool SharedStore::eraseGuild(uint64_t id) {
+  std::lock_guard<std::mutex> lock(guildMutex);
+  return writable && guilds.erase(id, 0);
+}
+
+bool SharedStore::eraseChannel(uint64_t id) {
+  std::lock_guard<std::mutex> lock(channelMutex);
+  return writable && channels.erase(id, 0);
+}
+
+bool SharedStore::eraseRole(uint64_t id) {
+  std::lock_guard<std::mutex> lock(roleMutex);
+  return writable && roles.erase(id, 0);
+}
+
+bool SharedStore::eraseMember(uint64_t guild, uint64_t user) {
+  std::lock_guard<std::mutex> lock(memberMutex);
+  return writable && members.erase(user, guild);
+}
+
+void SharedStore::purge(uint64_t guild) {
+  if (!writable) {
+    return;
+  }
+
+  {
+    std::lock_guard<std::mutex> lock(channelMutex);
+    channels.eraseIf([guild](uint64_t id, uint64_t scope, const Channel &c) {
+      return c.guild_id == guild;
+    });
+  }
+
+  {
+    std::lock_guard<std::mutex> lock(roleMutex);
+    roles.eraseIf([guild](uint64_t id, uint64_t scope, const Role &r) {
+      return r.guild_id == guild;
+    });
+  }
+
+  std::lock_guard<std::mutex> lock(memberMutex);
+  members.eraseIf([guild](uint64_t id, uint64_t scope, const Member &m) {
+    return scope == guild;
+  });
+}
+
+bool SharedStore::guild(uint64_t id, Guild *out) const {
+  return guilds.get(id, 0, out);
+}
+
+bool SharedStore::channel(uint64_t id, Channel *out) const {
+  return channels.get(id, 0, out);
+}
+
+bool SharedStore::role(uint64_t id, Role *out) const {
+  return roles.get(id, 0, out);
+}
+
+bool SharedStore::member(uint64_t guild, uint64_t user, Member *out) const {
+  return members.get(user, guild, out);
+}
+
+}  // namespace cache
+
+}  // namespace spectacles
@@ -0,0 +1,158 @@
+#include <utility>
+
+#include "../include/coalescer.h"
+
+namespace spectacles {
+
+PresenceCoalescer::PresenceCoalescer(int windowMs) : window(windowMs) {
+  thread = std::thread([this]() {
+    run();
+  });
+}
+
+PresenceCoalescer::~PresenceCoalescer() {
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    stopping = true;
+  }
+
+  wake.notify_one();
+  thread.join();
+}
+
+void PresenceCoalescer::onMessage(std::function<void(gateway::Packet)> handler) {
+  std::lock_guard<std::mutex> lock(handlerMutex);
+  messageHandler = handler;
+}
+
+void PresenceCoalescer::useMetrics(metrics::Registry *registry) {
+  receivedMetric = nullptr;
+  suppressedMetric = nullptr;
+  publishedMetric = nullptr;
+
+  if (registry) {
+    receivedMetric = &registry->counter("spectacles_presence_received_total", "Presence updates taken by the coalescer.");
+    suppressedMetric = &registry->counter("spectacles_presence_suppressed_total", "Presence updates replaced by a newer one before being passed on.");
+    publishedMetric = &registry->counter("spectacles_presence_published_total", "Presence updates passed on by the coalescer.");
+  }
+}
+
+void PresenceCoalescer::emit(gateway::Packet packet) {
+  std::lock_guard<std::mutex> lock(handlerMutex);
+  if (messageHandler) {
+    messageHandler(std::move(packet));
+  }
+}
+
+void PresenceCoalescer::push(gateway::Packet packet) {
+  if (packet.op != 0 || packet.t != "PRESENCE_UPDATE") {
+    emit(std::move(packet));
+    return;
+  }
+
+  receivedCount++;
+  if (receivedMetric) {
+    receivedMetric->add();
+  }
+
+  uint64_t guild = 0, user = 0;
+  etf::Header header;
+  if (packet.raw && etf::Scanner(packet.raw, packet.length).header(&header)) {
+    etf::Scanner d(header.d.data, header.d.length, true);
+    if (d.find("guild_id")) {
+      d.snowflake(&guild);
+    }
+
+    etf::Scanner u(header.d.data, header.d.length, true);
+    if (u.find("user") && u.find("id")) {
+      u.snowflake(&user);
+    }
+  }
+
+  // Without a member to key on there is nothing to coalesce with.
+  if (user == 0) {
+    publishedCount++;
+    if (publishedMetric) {
+      publishedMetric->add();
+    }
+
+    emit(std::move(packet));
+    return;
+  }
+
+  Key key(guild, user);
+  bool first;
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    auto it = held.find(key);
+    first = it == held.end();
+    if (first) {
+      held.insert(std::make_pair(key, std::move(packet)));
+      deadlines.push_back(std::make_pair(Clock::now() + window, key));
+    } else {
+      it->second = std::move(packet);
+    }
+  }
+
+  if (!first) {
+    suppressedCount++;
+    if (suppressedMetric) {
+      suppressedMetric->add();
+    }
+  } else {
+    wake.notify_one();
+  }
+}
+
+void PresenceCoalescer::run() {
+  std::unique_lock<std::mutex> lock(mutex);
+
+  while (true) {
+    if (deadlines.empty()) {
+      if (stopping) {
+        return;
+      }
+
+      wake.wait(lock);
+      continue;
+    }
+
+    // Every window is the same length, so deadlines are in order and only the front needs watching.
+    if (!stopping && Clock::now() < deadlines.front().first) {
+      wake.wait_until(lock, deadlines.front().first);
+      continue;
+    }
+
+    Key key = deadlines.front().second;
+    deadlines.pop_front();
+
+    auto it = held.find(key);
+    gateway::Packet packet = std::move(it->second);
+    held.erase(it);
+
+    lock.unlock();
+
+    publishedCount++;
+    if (publishedMetric) {
+      publishedMetric->add();
+    }
+
+    emit(std::move(packet));
+
+    lock.lock();
+  }
+}
+
+uint64_t PresenceCoalescer::received() const {
+  return receivedCount.load();
+}
+
+uint64_t PresenceCoalescer::suppressed() const {
+  return suppressedCount.load();
+}
+
+uint64_t PresenceCoalescer::published() const {
+  return publishedCount.load();
+}
+
+}  // namespace spectacles
@@ -0,0 +1,159 @@
+#include <algorithm>
+#include <chrono>
+#include <functional>
+#include <mutex>
+#include <thread>
+
+#include "../include/dispatch.h"
+
+namespace spectacles {
+
+static const int BATCH = 64;
+
+static thread_local DispatchPool *currentPool = nullptr;
+static thread_local size_t currentWorker = 0;
+
+DispatchPool::DispatchPool(size_t threads, size_t count) {
+  if (threads == 0) {
+    threads = std::max(std::thread::hardware_concurrency(), 1u);
+  }
+
+  for (size_t i = 0; i < std::max<size_t>(count, 1); i++) {
+    strands.emplace_back(new Strand());
+  }
+
+  for (size_t i = 0; i < threads; i++) {
+    workers.emplace_back(new Worker());
+  }
+
+  for (size_t i = 0; i < threads; i++) {
+    workers[i]->thread = std::thread(&DispatchPool::run, this, i);
+  }
+}
+
+DispatchPool::~DispatchPool() {
+  {
+    std::lock_guard<std::mutex> lock(idleMutex);
+    stopping = true;
+  }
+  idle.notify_all();
+
+  for (auto &worker : workers) {
+    worker->thread.join();
+  }
+}
+
+void DispatchPool::submit(uint64_t key, std::function<void()> task) {
+  size_t index = static_cast<size_t>((key * 0x9E3779B97F4A7C15ULL) >> 32) % strands.size();
+  Strand &strand = *strands[index];
+
+  bool wake = false;
+  {
+    std::lock_guard<std::mutex> lock(strand.mutex);
+    strand.tasks.push_back(std::move(task));
+    queued++;
+
+    if (!strand.scheduled) {
+      strand.scheduled = true;
+      wake = true;
+    }
+  }
+
+  if (wake) {
+    schedule(index);
+  }
+}
+
+size_t DispatchPool::pending() const {
+  return queued.load();
+}
+
+void DispatchPool::schedule(size_t strand) {
+  // Workers keep the strands they reschedule, which keeps a hot strand on a warm cache until someone steals it.
+  size_t worker = currentPool == this ? currentWorker : nextWorker++ % workers.size();
+
+  {
+    std::lock_guard<std::mutex> lock(workers[worker]->mutex);
+    workers[worker]->strands.push_back(strand);
+  }
+
+  {
+    std::lock_guard<std::mutex> lock(idleMutex);
+    runnable++;
+  }
+  idle.notify_one();
+}
+
+bool DispatchPool::take(size_t worker, size_t *strand) {
+  for (size_t i = 0; i < workers.size(); i++) {
+    Worker &victim = *workers[(worker + i) % workers.size()];
+    std::lock_guard<std::mutex> lock(victim.mutex);
+
+    if (victim.strands.empty()) {
+      continue;
+    }
+
+    if (i == 0) {
+      *strand = victim.strands.front();
+      victim.strands.pop_front();
+    } else {
+      *strand = victim.strands.back();
+      victim.strands.pop_back();
+    }
+
+    runnable--;
+    return true;
+  }
+
+  return false;
+}
+
+void DispatchPool::run(size_t worker) {
+  currentPool = this;
+  currentWorker = worker;
+
+  while (true) {
+    size_t index;
+    if (!take(worker, &index)) {
+      std::unique_lock<std::mutex> lock(idleMutex);
+      if (stopping && queued == 0) {
+        return;
+      }
+
+      idle.wait_for(lock, std::chrono::milliseconds(100), [this]() {
+        return runnable > 0 || stopping;
+      });
+      continue;
+    }
+
+    Strand &strand = *strands[index];
+    for (int i = 0; i < BATCH; i++) {
+      std::function<void()> task;
+      {
+        std::lock_guard<std::mutex> lock(strand.mutex);
+        if (strand.tasks.empty()) {
+          break;
+        }
+
+        task = std::move(strand.tasks.front());
+        strand.tasks.pop_front();
+      }
+
+      queued--;
+      task();
+    }
+
+    bool again;
+    {
+      std::lock_guard<std::mutex> lock(strand.mutex);
+      again = !strand.tasks.empty();
+      strand.scheduled = again;
+    }
+
+    if (again) {
+      schedule(index);
+    }
+  }
+}
+
+}  // namespace spectacles
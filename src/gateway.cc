@@ -1,5 +1,9 @@
+#include <algorithm>
 #include <chrono>
+#include <string>
 #include <thread>
+#include <utility>
+#include <vector>
 
 #include <cstring>
 #include <cstdlib>
@@ -7,6 +11,7 @@
 #include <uWS/uWS.h>
 
 #include "../include/gateway.h"
+#include "../include/recorder.h"
 
 #include "../include/etf/etf.h"
 
@@ -14,6 +19,34 @@ namespace spectacles {
 
 namespace gateway {
 
+static const int LAG_INTERVAL = 1000;
+
+static const char *opName(int op) {
+  switch (op) {
+    case 1:
+      return "HEARTBEAT";
+    case 7:
+      return "RECONNECT";
+    case 9:
+      return "INVALID_SESSION";
+    case 10:
+      return "HELLO";
+    case 11:
+      return "HEARTBEAT_ACK";
+    default:
+      return "UNKNOWN";
+  }
+}
+
+static int64_t micros() {
+  return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// Unlike micros(), comparable between processes and hosts, which is what Packet#received is read by.
+static int64_t wallMicros() {
+  return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+}
+
 void Connection::onError(std::function<void()> handler) {
   errorHandler = handler;
 }
@@ -30,17 +63,204 @@ void Connection::onMessage(std::function<void(Packet)> handler) {
   messageHandler = handler;
 }
 
-void Connection::send(char *data, size_t length) {
-  ws->send(data, length, uWS::OpCode::BINARY);
+void Connection::onMessage(std::function<void(const PacketView &)> handler) {
+  viewHandler = handler;
 }
 
-void Connection::send(etf::Data d) {
+void Connection::enqueue(std::string frame, bool priority) {
+  if (priority) {
+    control.push(std::move(frame));
+  } else {
+    outbound.push(std::move(frame));
+  }
+
+  // Held while sending, so the loop thread can't close the handle under us on a reconnect.
+  std::lock_guard<std::mutex> lock(asyncMutex);
+  if (async) {
+    async->send();
+  }
+}
+
+void Connection::enqueue(etf::Data d, bool priority) {
   etf::Encoder encoder;
   encoder.pack(d);
 
   etf::out_buf buf = encoder.release();
+  std::string frame(buf.buf, buf.length);
+  free(buf.buf);
+
+  enqueue(std::move(frame), priority);
+}
+
+void Connection::flush() {
+  std::string frame;
+  while (control.pop(&frame)) {
+    pendingControl.push_back(std::move(frame));
+  }
+
+  while (outbound.pop(&frame)) {
+    pendingOutbound.push_back(std::move(frame));
+  }
+
+  if (!open) {
+    return;
+  }
 
-  send(buf.buf, buf.length);
+  std::vector<std::string> batch;
+  while (!pendingControl.empty() && bucket.take(true)) {
+    batch.push_back(std::move(pendingControl.front()));
+    pendingControl.pop_front();
+  }
+
+  while (ready && !pendingOutbound.empty() && bucket.take()) {
+    batch.push_back(std::move(pendingOutbound.front()));
+    pendingOutbound.pop_front();
+  }
+
+  if (batch.size() == 1) {
+    ws->send(batch[0].data(), batch[0].size(), uWS::OpCode::BINARY);
+  } else if (batch.size() > 1) {
+    std::vector<int> excluded;
+    uWS::WebSocket<uWS::CLIENT>::PreparedMessage *prepared = uWS::WebSocket<uWS::CLIENT>::prepareMessageBatch(batch, excluded, uWS::OpCode::BINARY, false);
+    ws->sendPrepared(prepared);
+    uWS::WebSocket<uWS::CLIENT>::finalizeMessage(prepared);
+  }
+
+  if (queueMetric) {
+    queueMetric->set(pendingControl.size() + pendingOutbound.size());
+  }
+
+  if (!pendingControl.empty() || (ready && !pendingOutbound.empty())) {
+    throttle->start([](uS::Timer *timer) {
+      static_cast<Connection *>(timer->getData())->flush();
+    }, bucket.resetAfter() + 1, 0);
+  }
+}
+
+void Connection::measureLag() {
+  int64_t now = micros();
+  int64_t lag = now - lagTick - LAG_INTERVAL * 1000;
+  lagTick = now;
+
+  loopLag.record(lag > 0 ? lag : 0);
+}
+
+void Connection::count(const etf::Slice &event, size_t bytes) {
+  if (!options.metrics) {
+    return;
+  }
+
+  for (EventMetrics &m : eventMetrics) {
+    if (event.compare(m.name) == 0) {
+      m.messages->add();
+      m.bytes->add(bytes);
+      return;
+    }
+  }
+
+  metrics::Labels labels = {{"shard", std::to_string(options.shard_id)}, {"event", event.str()}};
+
+  EventMetrics m;
+  m.name = event.str();
+  m.messages = &options.metrics->counter("spectacles_gateway_messages_total", "Messages received from the gateway.", labels);
+  m.bytes = &options.metrics->counter("spectacles_gateway_bytes_total", "Bytes received from the gateway.", labels);
+  eventMetrics.push_back(m);
+
+  m.messages->add();
+  m.bytes->add(bytes);
+}
+
+Latency Connection::latency() const {
+  Latency l;
+  l.heartbeats = heartbeatRtt.count();
+  l.heartbeat_last = lastHeartbeatRtt.load();
+  l.heartbeat_p50 = heartbeatRtt.percentile(50);
+  l.heartbeat_p99 = heartbeatRtt.percentile(99);
+  l.heartbeat_max = heartbeatRtt.max();
+  l.acked = acked.load();
+  l.loop_lag_p50 = loopLag.percentile(50);
+  l.loop_lag_p99 = loopLag.percentile(99);
+  l.loop_lag_max = loopLag.max();
+
+  int64_t last = lastDispatchAt.load();
+  if (last != 0) {
+    l.since_dispatch = micros() - last;
+  }
+
+  return l;
+}
+
+void Connection::closeHandles() {
+  {
+    std::lock_guard<std::mutex> lock(asyncMutex);
+    if (async) {
+      async->close();
+      async = nullptr;
+    }
+  }
+
+  if (throttle) {
+    throttle->stop();
+    throttle->close();
+    throttle = nullptr;
+  }
+
+  if (lagTimer) {
+    lagTimer->stop();
+    lagTimer->close();
+    lagTimer = nullptr;
+  }
+
+  if (deferTimer) {
+    deferTimer->stop();
+    deferTimer->close();
+    deferTimer = nullptr;
+  }
+}
+
+bool Connection::filtered(const etf::Slice &t) const {
+  if (t.equals("READY") || t.equals("RESUMED")) {
+    return false;
+  }
+
+  auto less = [](const std::string &event, const etf::Slice &name) {
+    return name.compare(event) > 0;
+  };
+
+  if (!allowedEvents.empty()) {
+    auto it = std::lower_bound(allowedEvents.begin(), allowedEvents.end(), t, less);
+    if (it == allowedEvents.end() || t.compare(*it) != 0) {
+      return true;
+    }
+  }
+
+  auto it = std::lower_bound(ignoredEvents.begin(), ignoredEvents.end(), t, less);
+  return it != ignoredEvents.end() && t.compare(*it) == 0;
+}
+
+void Connection::track(int s) {
+  seq = s;
+
+  if (options.session_store) {
+    options.session_store->update(options.shard_id, s);
+  }
+}
+
+void Connection::forget() {
+  seq = -1;
+  session = "";
+
+  if (options.session_store) {
+    options.session_store->clear(options.shard_id);
+  }
+}
+
+void Connection::send(const char *data, size_t length) {
+  enqueue(std::string(data, length), false);
+}
+
+void Connection::send(etf::Data d) {
+  enqueue(d, false);
 }
 
 void Connection::send(Packet p) {
@@ -48,8 +268,7 @@ void Connection::send(Packet p) {
 }
 
 void Connection::identify() {
-  seq = -1;
-  session = "";
+  forget();
 
   etf::Data identify = etf::Data::Object();
   identify["op"] = 2;
@@ -67,7 +286,7 @@ void Connection::identify() {
   identify["d"]["shard"][1] = options.shard_count;
   identify["d"]["presence"] = options.presence;
 
-  send(identify);
+  enqueue(identify, true);
 }
 
 void Connection::resume() {
@@ -78,7 +297,7 @@ void Connection::resume() {
   resume["d"]["session_id"] = session;
   resume["d"]["seq"] = seq;
 
-  send(resume);
+  enqueue(resume, true);
 }
 
 void Connection::heartbeat() {
@@ -91,13 +310,62 @@ void Connection::heartbeat() {
     heartbeat["d"] = seq;
   }
 
-  send(heartbeat);
+  heartbeatSentAt.store(micros());
+  enqueue(heartbeat, true);
 }
 
 void Connection::connect(Options options) {
   uWS::Hub hub;
 
   this->options = options;
+  this->options.dispatch_batch = std::max(options.dispatch_batch, 1);
+  bucket = TokenBucket(options.rate_limit, options.rate_limit_interval);
+  allowedEvents.assign(options.events.begin(), options.events.end());
+  ignoredEvents.assign(options.ignored_events.begin(), options.ignored_events.end());
+
+  if (options.metrics) {
+    metrics::Labels labels = {{"shard", std::to_string(options.shard_id)}};
+    filteredMetric = &options.metrics->counter("spectacles_gateway_filtered_total", "Dispatches dropped by the event filter before decoding.", labels);
+    reconnectMetric = &options.metrics->counter("spectacles_gateway_reconnects_total", "Reconnects to the gateway.", labels);
+    queueMetric = &options.metrics->gauge("spectacles_gateway_outbound_queue", "Commands waiting to be sent to the gateway.", labels);
+    decodeMetric = &options.metrics->summary("spectacles_gateway_decode_seconds", "Time spent decoding gateway messages.", labels);
+  }
+
+  if (session.empty() && options.session_store) {
+    options.session_store->load(options.shard_id, options.resume_window, &session, &seq);
+  }
+
+  // A reconnect runs a fresh hub on top of the old one, so the previous loop's handles are retired first.
+  closeHandles();
+
+  throttle = new uS::Timer(hub.getLoop());
+  throttle->setData(this);
+
+  deferTimer = new uS::Timer(hub.getLoop());
+  deferTimer->setData(this);
+
+  if (!deferred.empty()) {
+    deferTimer->start([](uS::Timer *timer) {
+      static_cast<Connection *>(timer->getData())->drain();
+    }, 0, 0);
+  }
+
+  lagTick = micros();
+  lagTimer = new uS::Timer(hub.getLoop());
+  lagTimer->setData(this);
+  lagTimer->start([](uS::Timer *timer) {
+    static_cast<Connection *>(timer->getData())->measureLag();
+  }, LAG_INTERVAL, LAG_INTERVAL);
+
+  uS::Async *a = new uS::Async(hub.getLoop());
+  a->setData(this);
+  a->start([](uS::Async *handle) {
+    static_cast<Connection *>(handle->getData())->flush();
+  });
+  {
+    std::lock_guard<std::mutex> lock(asyncMutex);
+    async = a;
+  }
 
   hub.onError([this](void *user) {
     open = false;
@@ -111,14 +379,23 @@ void Connection::connect(Options options) {
   hub.onConnection([this](uWS::WebSocket<uWS::CLIENT> *ws, uWS::HttpRequest req) {
     this->ws = ws;
     open = true;
+    ready = false;
 
     if (connectionHandler) {
       connectionHandler();
     }
+
+    flush();
   });
 
   hub.onDisconnection([this](uWS::WebSocket<uWS::CLIENT> *ws, int code, char *message, size_t length) {
     open = false;
+    ready = false;
+
+    // Heartbeats and identifies were meant for the dead socket; the next one opens with its own IDENTIFY or RESUME.
+    pendingControl.clear();
+    std::string stale;
+    while (control.pop(&stale)) { }
 
     if (disconnectionHandler) {
       disconnectionHandler(code, std::string(message, length));
@@ -126,19 +403,20 @@ void Connection::connect(Options options) {
 
     if (tries == 5) {
       destroy();
+      closeHandles();
     } else {
       switch (code) {
         case 4004:
         case 4010:
         case 4011:
           destroy();
+          closeHandles();
           return;
 
         case 4003:
         case 4007:
         case 4009:
-          seq = -1;
-          session = "";
+          forget();
 
         default:
           reconnect();
@@ -147,89 +425,253 @@ void Connection::connect(Options options) {
     }
   });
 
-  hub.onMessage([this, options](uWS::WebSocket<uWS::CLIENT> *ws, char *raw, size_t length, uWS::OpCode opCode) {
-    etf::Decoder decoder(reinterpret_cast<uint8_t *>(raw), length);
-    etf::Data d = decoder.unpack();
+  hub.onMessage([this](uWS::WebSocket<uWS::CLIENT> *ws, char *raw, size_t length, uWS::OpCode opCode) {
+    receive(raw, length);
+  });
+
+  hub.connect(options.url);
+
+  hub.run();
+}
 
-    int op = d["op"];
+void Connection::receive(char *raw, size_t length) {
+  int64_t received = wallMicros();
 
-    if (op == 10) {
-      int heartbeatInterval = d["d"]["heartbeat_interval"];
+  if (options.recorder) {
+    options.recorder->record(options.shard_id, raw, length);
+  }
 
-      if (session.size() > 0) {
-        resume();
-      } else {
-        identify();
-      }
+  etf::Header header;
+  bool scanned = false;
 
-      acked = true;
+  if (!allowedEvents.empty() || !ignoredEvents.empty() || options.dispatch_pool || options.defer_dispatches || options.cache) {
+    scanned = etf::Scanner(raw, length).header(&header);
+  }
 
-      if (!heartbeatStarted) {
-        heartbeatStarted = true;
-        std::thread([ws, this, heartbeatInterval]() {
-          while (heartbeatOpen) {
-            std::this_thread::sleep_for(std::chrono::milliseconds(heartbeatInterval));
+  if (scanned && header.op == 0 && options.cache) {
+    options.cache->apply(header.t, header.d);
+  }
 
-            if (!acked) {
-              reconnect(4009);
-              std::terminate();
-            }
+  if (scanned && header.op == 0 && filtered(header.t)) {
+    lastDispatchAt.store(micros());
+    track(header.s);
+    count(header.t, length);
 
-            if (open) {
-              acked = false;
-              heartbeat();
-            }
-          }
-        }).detach();
-      } else {
-        heartbeat();
+    if (filteredMetric) {
+      filteredMetric->add();
+    }
+    return;
+  }
+
+  if (scanned && header.op == 0 && (options.dispatch_pool || options.defer_dispatches)) {
+    etf::Slice sessionId;
+    if (header.t.equals("READY")) {
+      etf::Scanner d(header.d.data, header.d.length, true);
+      if (d.find("session_id")) {
+        d.string(&sessionId);
       }
-    } else if (op == 0) {
-      seq = d["s"];
+    }
 
-      std::string t = d["t"];
-      if (t == "READY") {
-        std::string session = d["d"]["session_id"];
-        this->session = session;
-        tries = 0;
+    dispatched(header.s, header.t, sessionId);
+    count(header.t, length);
+
+    Buffer frame(raw, length);
+
+    if (!options.dispatch_pool) {
+      deferred.push_back(std::make_pair(frame, received));
+      if (deferred.size() == 1) {
+        deferTimer->start([](uS::Timer *timer) {
+          static_cast<Connection *>(timer->getData())->drain();
+        }, 0, 0);
       }
-    } else if (op == 11) {
-      acked = true;
-    } else if (op == 7) {
-      reconnect();
-    } else if (op == 9) {
-      bool d = d["d"];
-      if (d) {
-        resume();
-      } else {
-        reconnect();
+      return;
+    }
+
+    uint64_t key = options.shard_id;
+    if (options.dispatch_order == ORDER_BY_GUILD) {
+      etf::Scanner d(header.d.data, header.d.length, true);
+      uint64_t guild;
+      if (d.find("guild_id") && d.snowflake(&guild)) {
+        key = guild;
       }
-    } else if (op == 1) {
+    }
+
+    options.dispatch_pool->submit(key, [this, frame, received]() {
+      handleDispatch(frame.data(), frame.size(), received);
+    });
+    return;
+  }
+
+  int64_t decodeStart = decodeMetric ? micros() : 0;
+
+  etf::Decoder decoder(reinterpret_cast<uint8_t *>(raw), length);
+  etf::Data d = decoder.unpack();
+
+  if (decodeMetric) {
+    decodeMetric->record(micros() - decodeStart);
+  }
+
+  int op = d["op"];
+
+  if (options.metrics) {
+    if (op == 0) {
+      std::string t = d["t"];
+      count(etf::Slice(t.data(), t.size()), length);
+    } else {
+      const char *name = opName(op);
+      count(etf::Slice(name, strlen(name)), length);
+    }
+  }
+
+  if (op == 10) {
+    int heartbeatInterval = d["d"]["heartbeat_interval"];
+    bucket.reserve(options.rate_limit_interval / heartbeatInterval + 2);
+
+    if (session.size() > 0) {
+      resume();
+    } else {
+      identify();
+    }
+
+    acked = true;
+
+    if (!heartbeatStarted) {
+      heartbeatStarted = true;
+      std::thread([this, heartbeatInterval]() {
+        while (heartbeatOpen) {
+          std::this_thread::sleep_for(std::chrono::milliseconds(heartbeatInterval));
+
+          if (!acked) {
+            reconnect(4009);
+            std::terminate();
+          }
+
+          if (open) {
+            acked = false;
+            heartbeat();
+          }
+        }
+      }).detach();
+    } else {
       heartbeat();
     }
+  } else if (op == 0) {
+    std::string t = d["t"];
+    std::string sessionId;
+    if (t == "READY") {
+      std::string id = d["d"]["session_id"];
+      sessionId = id;
+    }
+
+    dispatched(d["s"], etf::Slice(t.data(), t.size()), etf::Slice(sessionId.data(), sessionId.size()));
+  } else if (op == 11) {
+    acked = true;
+
+    int64_t sent = heartbeatSentAt.exchange(0);
+    if (sent != 0) {
+      uint64_t rtt = micros() - sent;
+      heartbeatRtt.record(rtt);
+      lastHeartbeatRtt.store(rtt);
+    }
+  } else if (op == 7) {
+    reconnect();
+  } else if (op == 9) {
+    bool resumable = d["d"];
+    if (resumable) {
+      resume();
+    } else {
+      forget();
+      reconnect();
+    }
+  } else if (op == 1) {
+    heartbeat();
+  }
 
-    if (messageHandler) {
-      Packet p;
-      p.op = d["op"];
-      p.d = d["d"];
-      p.length = length;
+  deliver(&d, op, raw, length, received);
+}
 
-      p.raw = static_cast<char *>(malloc(length * sizeof(char)));
-      memcpy(p.raw, raw, length);
+void Connection::handleDispatch(const char *raw, size_t length, int64_t received) {
+  int64_t decodeStart = decodeMetric ? micros() : 0;
 
-      if (op == 0) {
-        std::string t = d["t"];
-        p.t = t;
-        p.s = d["s"];
-      }
+  etf::Decoder decoder(reinterpret_cast<const uint8_t *>(raw), length);
+  etf::Data d = decoder.unpack();
+
+  if (decodeMetric) {
+    decodeMetric->record(micros() - decodeStart);
+  }
+
+  deliver(&d, 0, raw, length, received);
+}
 
-      messageHandler(p);
+void Connection::drain() {
+  for (int i = 0; i < options.dispatch_batch && !deferred.empty(); i++) {
+    std::pair<Buffer, int64_t> frame = std::move(deferred.front());
+    deferred.pop_front();
+    handleDispatch(frame.first.data(), frame.first.size(), frame.second);
+  }
+
+  // Going back to the loop between batches lets control opcodes that arrived meanwhile jump ahead of the backlog.
+  if (!deferred.empty() && deferTimer) {
+    deferTimer->start([](uS::Timer *timer) {
+      static_cast<Connection *>(timer->getData())->drain();
+    }, 0, 0);
+  }
+}
+
+void Connection::dispatched(int s, const etf::Slice &t, const etf::Slice &sessionId) {
+  lastDispatchAt.store(micros());
+  track(s);
+
+  if (t.equals("READY")) {
+    session = sessionId.str();
+    tries = 0;
+
+    if (options.session_store) {
+      options.session_store->save(options.shard_id, session, seq);
     }
-  });
+  }
 
-  hub.connect("wss://gateway.discord.gg/?v=6&encoding=etf");
+  if (t.equals("READY") || t.equals("RESUMED")) {
+    ready = true;
+    flush();
+  }
+}
 
-  hub.run();
+void Connection::deliver(etf::Data *d, int op, const char *raw, size_t length, int64_t received) {
+  if (viewHandler) {
+    PacketView view(&(*d)["d"], raw, length);
+    view.op = op;
+    view.received = received;
+    view.shard = options.shard_id;
+
+    if (op == 0) {
+      std::string t = (*d)["t"];
+      view.t = t;
+      view.s = (*d)["s"];
+    }
+
+    viewHandler(view);
+  }
+
+  if (messageHandler) {
+    Packet p;
+    p.op = op;
+    p.d = std::move((*d)["d"]);
+    p.length = length;
+    p.received = received;
+    p.shard = options.shard_id;
+
+    p.raw = static_cast<char *>(malloc(length * sizeof(char)));
+    memcpy(p.raw, raw, length);
+
+    if (op == 0) {
+      std::string t = (*d)["t"];
+      p.t = t;
+      p.s = (*d)["s"];
+    }
+
+    messageHandler(std::move(p));
+  }
 }
 
 void Connection::disconnect(int code) {
@@ -239,6 +681,10 @@ void Connection::disconnect(int code) {
 }
 
 void Connection::reconnect(int code) {
+  if (reconnectMetric) {
+    reconnectMetric->add();
+  }
+
   disconnect(code);
   std::this_thread::sleep_for(std::chrono::milliseconds(5500 + (rand() % 10 + 1)));
   connect(options);
@@ -0,0 +1,94 @@
+#include <algorithm>
+
+#include "../include/histogram.h"
+
+namespace spectacles {
+
+Histogram::Histogram() {
+  reset();
+}
+
+int Histogram::bucket(uint64_t value) {
+  if (value < 8) {
+    return static_cast<int>(value);
+  }
+
+  int exponent = 63 - __builtin_clzll(value);
+  int index = (exponent - 2) * 8 + static_cast<int>((value >> (exponent - 3)) & 7);
+  return std::min(index, BUCKETS - 1);
+}
+
+uint64_t Histogram::lowerBound(int bucket) {
+  if (bucket < 8) {
+    return bucket;
+  }
+
+  int exponent = bucket / 8 + 2;
+  return static_cast<uint64_t>(8 + bucket % 8) << (exponent - 3);
+}
+
+void Histogram::record(uint64_t value) {
+  buckets[bucket(value)].fetch_add(1, std::memory_order_relaxed);
+  total.fetch_add(1, std::memory_order_relaxed);
+  accumulated.fetch_add(value, std::memory_order_relaxed);
+
+  uint64_t current = largest.load(std::memory_order_relaxed);
+  while (value > current && !largest.compare_exchange_weak(current, value, std::memory_order_relaxed)) { }
+}
+
+uint64_t Histogram::percentile(double p) const {
+  uint64_t n = count();
+  if (n == 0) {
+    return 0;
+  }
+
+  uint64_t rank = static_cast<uint64_t>(n * std::min(std::max(p, 0.0), 100.0) / 100.0);
+  if (rank == 0) {
+    rank = 1;
+  }
+
+  uint64_t seen = 0;
+  for (int i = 0; i < BUCKETS; i++) {
+    seen += buckets[i].load(std::memory_order_relaxed);
+    if (seen >= rank) {
+      uint64_t low = lowerBound(i);
+      uint64_t high = i + 1 < BUCKETS ? lowerBound(i + 1) : low;
+      return std::min(low + (high - low) / 2, max());
+    }
+  }
+
+  return max();
+}
+
+uint64_t Histogram::count() const {
+  return total.load(std::memory_order_relaxed);
+}
+
+uint64_t Histogram::sum() const {
+  return accumulated.load(std::memory_order_relaxed);
+}
+
+uint64_t Histogram::max() const {
+  return largest.load(std::memory_order_relaxed);
+}
+
+uint64_t Histogram::countBelow(uint64_t bound) const {
+  uint64_t n = 0;
+  for (int i = 0; i < BUCKETS && lowerBound(i) <= bound; i++) {
+    n += buckets[i].load(std::memory_order_relaxed);
+  }
+
+  return n;
+}
+
+void Histogram::reset() {
+  for (int i = 0; i < BUCKETS; i++) {
+    buckets[i].store(0, std::memory_order_relaxed);
+  }
+
+  total.store(0, std::memory_order_relaxed);
+  accumulated.store(0, std::memory_order_relaxed);
+  largest.store(0, std::memory_order_relaxed);
+}
+
+}  // namespace spectacles
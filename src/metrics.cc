@@ -0,0 +1,187 @@
+#include <cassert>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+
+#include <uWS/uWS.h>
+
+#include "../include/metrics.h"
+
+namespace spectacles {
+
+namespace metrics {
+
+static std::atomic<int> nextShard{0};
+
+static std::string escape(const std::string &value) {
+  std::string escaped;
+  for (char c : value) {
+    if (c == '\\' || c == '"') {
+      escaped += '\\';
+      escaped += c;
+    } else if (c == '\n') {
+      escaped += "\\n";
+    } else {
+      escaped += c;
+    }
+  }
+
+  return escaped;
+}
+
+static std::string format(const Labels &labels) {
+  std::string out;
+  for (auto const &label : labels) {
+    out += out.empty() ? "{" : ",";
+    out += label.first + "=\"" + escape(label.second) + "\"";
+  }
+
+  return out.empty() ? out : out + "}";
+}
+
+static std::string withLabel(const std::string &labels, const std::string &label) {
+  if (labels.empty()) {
+    return "{" + label + "}";
+  }
+
+  return labels.substr(0, labels.size() - 1) + "," + label + "}";
+}
+
+void Counter::add(uint64_t n) {
+  static thread_local int shard = nextShard.fetch_add(1, std::memory_order_relaxed) % SHARDS;
+  shards[shard].value.fetch_add(n, std::memory_order_relaxed);
+}
+
+uint64_t Counter::value() const {
+  uint64_t total = 0;
+  for (int i = 0; i < SHARDS; i++) {
+    total += shards[i].value.load(std::memory_order_relaxed);
+  }
+
+  return total;
+}
+
+Registry &Registry::global() {
+  static Registry registry;
+  return registry;
+}
+
+Registry::Family &Registry::family(const std::string &name, const std::string &help, Type type) {
+  auto it = families.find(name);
+  if (it == families.end()) {
+    Family &f = families[name];
+    f.type = type;
+    f.help = help;
+    return f;
+  }
+
+  // Rendering one family under two types would produce an exposition Prometheus rejects.
+  assert(it->second.type == type);
+  if (it->second.type != type) {
+    Family &f = mismatched[name + "/" + std::to_string(type)];
+    f.type = type;
+    return f;
+  }
+
+  return it->second;
+}
+
+Counter &Registry::counter(const std::string &name, const std::string &help, const Labels &labels) {
+  std::lock_guard<std::mutex> lock(mutex);
+  std::unique_ptr<Counter> &c = family(name, help, COUNTER).counters[format(labels)];
+  if (!c) {
+    c.reset(new Counter());
+  }
+
+  return *c;
+}
+
+Gauge &Registry::gauge(const std::string &name, const std::string &help, const Labels &labels) {
+  std::lock_guard<std::mutex> lock(mutex);
+  std::unique_ptr<Gauge> &g = family(name, help, GAUGE).gauges[format(labels)];
+  if (!g) {
+    g.reset(new Gauge());
+  }
+
+  return *g;
+}
+
+Histogram &Registry::summary(const std::string &name, const std::string &help, const Labels &labels) {
+  std::lock_guard<std::mutex> lock(mutex);
+  std::unique_ptr<Histogram> &h = family(name, help, SUMMARY).summaries[format(labels)];
+  if (!h) {
+    h.reset(new Histogram());
+  }
+
+  return *h;
+}
+
+std::string Registry::render() const {
+  std::lock_guard<std::mutex> lock(mutex);
+  std::ostringstream out;
+
+  for (auto const &entry : families) {
+    const std::string &name = entry.first;
+    const Family &f = entry.second;
+
+    out << "# HELP " << name << " " << f.help << "\n";
+
+    if (f.type == COUNTER) {
+      out << "# TYPE " << name << " counter\n";
+      for (auto const &c : f.counters) {
+        out << name << c.first << " " << c.second->value() << "\n";
+      }
+    } else if (f.type == GAUGE) {
+      out << "# TYPE " << name << " gauge\n";
+      for (auto const &g : f.gauges) {
+        out << name << g.first << " " << g.second->value() << "\n";
+      }
+    } else {
+      out << "# TYPE " << name << " summary\n";
+      for (auto const &s : f.summaries) {
+        const Histogram &h = *s.second;
+        for (double q : {0.5, 0.9, 0.99}) {
+          std::ostringstream quantile;
+          quantile << "quantile=\"" << q << "\"";
+          out << name << withLabel(s.first, quantile.str()) << " " << h.percentile(q * 100) / 1e6 << "\n";
+        }
+
+        out << name << "_sum" << s.first << " " << h.sum() / 1e6 << "\n";
+        out << name << "_count" << s.first << " " << h.count() << "\n";
+      }
+    }
+  }
+
+  return out.str();
+}
+
+bool Server::listen(int port, Registry *registry) {
+  // Shared with the thread, which may still be inside set_value when this returns.
+  std::shared_ptr<std::promise<bool>> listening = std::make_shared<std::promise<bool>>();
+  std::future<bool> result = listening->get_future();
+
+  std::thread([port, registry, listening]() {
+    uWS::Hub hub;
+
+    hub.onHttpRequest([registry](uWS::HttpResponse *res, uWS::HttpRequest req, char *data, size_t length, size_t remaining) {
+      std::string body = registry->render();
+      res->end(body.data(), body.size());
+    });
+
+    bool ok = hub.listen(port);
+    listening->set_value(ok);
+
+    if (ok) {
+      hub.run();
+    }
+  }).detach();
+
+  return result.get();
+}
+
+}  // namespace metrics
+
+}  // namespace spectacles
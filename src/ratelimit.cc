@@ -0,0 +1,46 @@
+#include <algorithm>
+#include <chrono>
+
+#include "../include/ratelimit.h"
+
+namespace spectacles {
+
+TokenBucket::TokenBucket(int c, int i, int r) : capacity(c), reserved(std::min(r, c)), tokens(c), interval(i), windowStart(clock::now()) { }
+
+void TokenBucket::refill() {
+  clock::time_point now = clock::now();
+  if (now - windowStart >= interval) {
+    windowStart = now;
+    tokens = capacity;
+  }
+}
+
+void TokenBucket::reserve(int r) {
+  reserved = std::min(r, capacity);
+}
+
+bool TokenBucket::take(bool priority) {
+  if (available(priority) == 0) {
+    return false;
+  }
+
+  tokens--;
+  return true;
+}
+
+int TokenBucket::available(bool priority) {
+  refill();
+
+  if (priority) {
+    return tokens;
+  }
+
+  return std::max(tokens - reserved, 0);
+}
+
+int TokenBucket::resetAfter() {
+  std::chrono::milliseconds elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(clock::now() - windowStart);
+  return std::max(static_cast<int>((interval - elapsed).count()), 0);
+}
+
+}  // namespace spectacles
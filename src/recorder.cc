@@ -0,0 +1,305 @@
+#include <algorithm>
+#include <chrono>
+#include <string>
+#include <thread>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cstdlib>
+#include <cstring>
+
+#include "../include/recorder.h"
+
+#include "../include/etf/etf.h"
+
+namespace spectacles {
+
+namespace gateway {
+
+static const uint32_t RECORDER_MAGIC = 0x53505243;
+static const uint32_t RECORDER_VERSION = 1;
+
+// The size of Recorder::Layout, which precedes the first frame.
+static const size_t LOG_HEADER = 16;
+
+struct FrameHeader {
+  int64_t timestamp;
+  uint32_t shard;
+  uint32_t length;
+};
+
+static size_t padded(size_t length) {
+  return (length + 7) & ~static_cast<size_t>(7);
+}
+
+static int64_t nanos() {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+}
+
+Recorder::~Recorder() {
+  if (layout) {
+    size_t end = layout->end.load();
+    munmap(layout, size);
+    layout = nullptr;
+
+    if (ftruncate(fd, end) != 0) {
+      // The log is still readable with trailing zeroes, they are past Layout#end.
+    }
+  }
+
+  drop();
+}
+
+void Recorder::drop() {
+  if (layout) {
+    munmap(layout, size);
+    layout = nullptr;
+  }
+
+  if (fd != -1) {
+    close(fd);
+    fd = -1;
+  }
+
+  size = 0;
+}
+
+bool Recorder::open(const std::string &path, size_t capacity) {
+  std::lock_guard<std::mutex> lock(mutex);
+
+  if (fd != -1) {
+    return false;
+  }
+
+  fd = ::open(path.c_str(), O_RDWR | O_CREAT, 0644);
+  if (fd == -1) {
+    return false;
+  }
+
+  struct stat st;
+  if (fstat(fd, &st) != 0) {
+    drop();
+    return false;
+  }
+
+  // An existing file is checked before it is resized, so one that is not a log is left as it was.
+  bool fresh = st.st_size == 0;
+  uint32_t header[2];
+  if (!fresh && (static_cast<size_t>(st.st_size) < LOG_HEADER || pread(fd, header, sizeof(header), 0) != sizeof(header)
+      || header[0] != RECORDER_MAGIC || header[1] != RECORDER_VERSION)) {
+    drop();
+    return false;
+  }
+
+  size = std::max(static_cast<size_t>(st.st_size), std::max(capacity, LOG_HEADER));
+  if (ftruncate(fd, size) != 0) {
+    drop();
+    return false;
+  }
+
+  void *memory = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (memory == MAP_FAILED) {
+    drop();
+    return false;
+  }
+
+  layout = static_cast<Layout *>(memory);
+
+  if (fresh) {
+    layout->magic = RECORDER_MAGIC;
+    layout->version = RECORDER_VERSION;
+    layout->end.store(LOG_HEADER);
+  }
+
+  return true;
+}
+
+bool Recorder::grow(size_t needed) {
+  size_t next = size;
+  while (next < needed) {
+    next *= 2;
+  }
+
+  if (munmap(layout, size) != 0 || ftruncate(fd, next) != 0) {
+    layout = nullptr;
+    return false;
+  }
+
+  void *memory = mmap(nullptr, next, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (memory == MAP_FAILED) {
+    layout = nullptr;
+    return false;
+  }
+
+  layout = static_cast<Layout *>(memory);
+  size = next;
+  return true;
+}
+
+void Recorder::record(int shard, const char *data, size_t length) {
+  FrameHeader header;
+  header.timestamp = nanos();
+  header.shard = shard;
+  header.length = length;
+
+  std::lock_guard<std::mutex> lock(mutex);
+
+  if (!layout) {
+    return;
+  }
+
+  size_t end = layout->end.load(std::memory_order_relaxed);
+  size_t needed = end + sizeof(FrameHeader) + padded(length);
+  if (needed > size && !grow(needed)) {
+    return;
+  }
+
+  char *out = reinterpret_cast<char *>(layout) + end;
+  memcpy(out, &header, sizeof(FrameHeader));
+  memcpy(out + sizeof(FrameHeader), data, length);
+
+  layout->end.store(needed, std::memory_order_release);
+}
+
+size_t Recorder::recorded() const {
+  std::lock_guard<std::mutex> lock(mutex);
+  return layout ? layout->end.load(std::memory_order_acquire) : 0;
+}
+
+Replayer::~Replayer() {
+  drop();
+}
+
+void Replayer::drop() {
+  if (memory) {
+    munmap(const_cast<char *>(memory), size);
+    memory = nullptr;
+  }
+
+  if (fd != -1) {
+    close(fd);
+    fd = -1;
+  }
+
+  size = 0;
+}
+
+bool Replayer::open(const std::string &path) {
+  if (fd != -1) {
+    return false;
+  }
+
+  fd = ::open(path.c_str(), O_RDONLY);
+  if (fd == -1) {
+    return false;
+  }
+
+  struct stat st;
+  if (fstat(fd, &st) != 0 || static_cast<size_t>(st.st_size) < LOG_HEADER) {
+    drop();
+    return false;
+  }
+
+  size = st.st_size;
+  void *mapped = mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+  if (mapped == MAP_FAILED) {
+    drop();
+    return false;
+  }
+
+  memory = static_cast<const char *>(mapped);
+
+  uint32_t magic, version;
+  uint64_t end;
+  memcpy(&magic, memory, sizeof(magic));
+  memcpy(&version, memory + 4, sizeof(version));
+  memcpy(&end, memory + 8, sizeof(end));
+
+  if (magic != RECORDER_MAGIC || version != RECORDER_VERSION) {
+    drop();
+    return false;
+  }
+
+  // Frames written after opening are not replayed.
+  size = std::min(size, static_cast<size_t>(end));
+  rewind();
+  return true;
+}
+
+bool Replayer::next(Frame *frame) {
+  if (!memory || offset + sizeof(FrameHeader) > size) {
+    return false;
+  }
+
+  FrameHeader header;
+  memcpy(&header, memory + offset, sizeof(FrameHeader));
+
+  if (offset + sizeof(FrameHeader) + header.length > size) {
+    return false;
+  }
+
+  frame->timestamp = header.timestamp;
+  frame->shard = header.shard;
+  frame->data = memory + offset + sizeof(FrameHeader);
+  frame->length = header.length;
+
+  offset += sizeof(FrameHeader) + padded(header.length);
+  return true;
+}
+
+void Replayer::rewind() {
+  offset = LOG_HEADER;
+}
+
+size_t Replayer::replay(std::function<void(const Frame &)> handler, double speed) {
+  size_t replayed = 0;
+  int64_t first = 0;
+  std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+  Frame frame;
+  while (next(&frame)) {
+    if (speed > 0) {
+      if (replayed == 0) {
+        first = frame.timestamp;
+      }
+
+      std::chrono::nanoseconds due(static_cast<int64_t>((frame.timestamp - first) / speed));
+      std::this_thread::sleep_until(start + due);
+    }
+
+    handler(frame);
+    replayed++;
+  }
+
+  return replayed;
+}
+
+size_t Replayer::replay(std::function<void(int, Packet)> handler, double speed) {
+  return replay(std::function<void(const Frame &)>([&handler](const Frame &frame) {
+    etf::Decoder decoder(reinterpret_cast<const uint8_t *>(frame.data), frame.length);
+    etf::Data d = decoder.unpack();
+
+    Packet p;
+    p.op = d["op"];
+    p.d = std::move(d["d"]);
+    p.length = frame.length;
+
+    p.raw = static_cast<char *>(malloc(frame.length * sizeof(char)));
+    memcpy(p.raw, frame.data, frame.length);
+
+    if (p.op == 0) {
+      std::string t = d["t"];
+      p.t = t;
+      p.s = d["s"];
+    }
+
+    handler(frame.shard, std::move(p));
+  }), speed);
+}
+
+}  // namespace gateway
+
+}  // namespace spectacles
@@ -0,0 +1,362 @@
+#include <atomic>
+#include <chrono>
+#include <set>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cstring>
+
+#include "../include/ring.h"
+
+namespace spectacles {
+
+namespace brokers {
+
+static const uint32_t RING_MAGIC = 0x53524e47;
+static const uint32_t RING_VERSION = 1;
+static const uint16_t RECORD_PADDING = 1;
+
+// reserved runs ahead of head while a record is being written, so a reader can tell after copying a record whether
+// the writer may have started overwriting it.
+struct SharedRing::Header {
+  uint32_t magic;
+  uint32_t version;
+  uint64_t capacity;
+  std::atomic<uint64_t> reserved;
+  std::atomic<uint64_t> head;
+  char padding[32];
+};
+
+struct RecordHeader {
+  uint32_t bodyLength;
+  uint16_t keyLength;
+  uint16_t flags;
+  uint64_t sequence;
+};
+
+// Records are aligned to their header size, so whatever is left before the end of the ring fits a padding record.
+static uint64_t recordSize(size_t keyLength, size_t bodyLength) {
+  return (sizeof(RecordHeader) + keyLength + bodyLength + 15) & ~static_cast<uint64_t>(15);
+}
+
+static bool powerOfTwo(uint64_t n) {
+  return n >= 64 && (n & (n - 1)) == 0;
+}
+
+class SharedRing::Reader : public Subscription {
+ private:
+  const Header *header;
+  const char *data;
+  uint64_t capacity;
+  std::string path;
+  ino_t inode;
+  size_t mapped = 0;
+  std::set<std::string> keys;
+  uint64_t position;
+  uint64_t sequence = 0;
+  bool counting = false;
+  uint64_t missed = 0;
+  std::vector<char> record;
+  std::string key;
+
+  // Copies the record at position, returning its size or 0 if the writer got to it first.
+  uint64_t copy(RecordHeader *out) {
+    const char *at = data + (position & (capacity - 1));
+    memcpy(out, at, sizeof(RecordHeader));
+
+    // A torn header can hold anything, so bound the copy before trusting it. Records never wrap.
+    uint64_t size = recordSize(out->keyLength, out->bodyLength);
+    bool sane = size <= capacity - (position & (capacity - 1));
+    if (sane && !(out->flags & RECORD_PADDING)) {
+      record.assign(at + sizeof(RecordHeader), at + sizeof(RecordHeader) + out->keyLength + out->bodyLength);
+    }
+
+    std::atomic_thread_fence(std::memory_order_acquire);
+    bool intact = header->reserved.load(std::memory_order_relaxed) - position <= capacity;
+    return sane && intact ? size : 0;
+  }
+
+  // Moves over to the ring now at path if it is a different file, as after the publisher restarted. Nothing more is
+  // published into the old one.
+  bool reattach() {
+    struct stat st;
+    if (path.empty() || stat(path.c_str(), &st) != 0 || st.st_ino == inode) {
+      return false;
+    }
+
+    size_t size;
+    ino_t replaced;
+    const Header *next = map(path, &size, &replaced);
+    if (!next) {
+      return false;
+    }
+
+    if (mapped) {
+      munmap(const_cast<Header *>(header), mapped);
+    }
+
+    header = next;
+    data = reinterpret_cast<const char *>(next) + sizeof(Header);
+    capacity = next->capacity;
+    inode = replaced;
+    mapped = size;
+
+    // Everything in the new ring came after the old one, so it is read from the start unless already overwritten, in
+    // which case the sequence of the first record read says how much was lost.
+    uint64_t head = header->head.load(std::memory_order_acquire);
+    position = head > capacity ? head : 0;
+    sequence = 0;
+    counting = true;
+    return true;
+  }
+
+ public:
+  Reader(const Header *header_, const char *data_, const std::string &path_, ino_t inode_,
+         const std::vector<std::string> &keys_)
+      : header(header_), data(data_), capacity(header_->capacity), path(path_), inode(inode_),
+        keys(keys_.begin(), keys_.end()), position(header_->head.load(std::memory_order_acquire)) { }
+
+  ~Reader() {
+    if (mapped) {
+      munmap(const_cast<Header *>(header), mapped);
+    }
+  }
+
+  bool next(Envelope *out, int timeout) override {
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeout);
+    int idle = 0;
+
+    while (true) {
+      uint64_t head = header->head.load(std::memory_order_acquire);
+      if (position == head) {
+        if (++idle < 64) {
+          std::this_thread::yield();
+        } else if (std::chrono::steady_clock::now() >= deadline) {
+          if (!reattach()) {
+            return false;
+          }
+
+          idle = 0;
+        } else {
+          std::this_thread::sleep_for(std::chrono::microseconds(50));
+        }
+        continue;
+      }
+
+      idle = 0;
+
+      RecordHeader current;
+      uint64_t size = head - position > capacity ? 0 : copy(&current);
+      if (size == 0) {
+        // Lapped by the writer; the sequence gap of the next record read says how much was lost.
+        position = header->head.load(std::memory_order_acquire);
+        continue;
+      }
+
+      position += size;
+      if (current.flags & RECORD_PADDING) {
+        continue;
+      }
+
+      if (counting && current.sequence > sequence + 1) {
+        missed += current.sequence - sequence - 1;
+      }
+      sequence = current.sequence;
+      counting = true;
+
+      key.assign(record.data(), current.keyLength);
+      if (!keys.empty() && keys.count(key) == 0) {
+        continue;
+      }
+
+      out->key = key;
+      out->body = record.data() + current.keyLength;
+      out->length = current.bodyLength;
+      return true;
+    }
+  }
+
+  uint64_t dropped() const override {
+    return missed;
+  }
+};
+
+SharedRing::~SharedRing() {
+  drop();
+}
+
+void SharedRing::drop() {
+  if (memory) {
+    munmap(memory, size);
+    memory = nullptr;
+  }
+
+  if (fd != -1) {
+    close(fd);
+    fd = -1;
+  }
+
+  path.clear();
+  inode = 0;
+  header = nullptr;
+  data = nullptr;
+  writable = false;
+}
+
+const SharedRing::Header *SharedRing::map(const std::string &file, size_t *size, ino_t *inode) {
+  int fd = ::open(file.c_str(), O_RDONLY);
+  if (fd == -1) {
+    return nullptr;
+  }
+
+  struct stat st;
+  void *memory = MAP_FAILED;
+  if (fstat(fd, &st) == 0 && static_cast<size_t>(st.st_size) >= sizeof(Header)) {
+    memory = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  }
+
+  // The mapping outlives the descriptor.
+  close(fd);
+  if (memory == MAP_FAILED) {
+    return nullptr;
+  }
+
+  const Header *header = static_cast<const Header *>(memory);
+  bool valid = header->magic == RING_MAGIC;
+  std::atomic_thread_fence(std::memory_order_acquire);
+
+  if (!valid || header->version != RING_VERSION || !powerOfTwo(header->capacity)
+      || sizeof(Header) + header->capacity != static_cast<size_t>(st.st_size)) {
+    munmap(memory, st.st_size);
+    return nullptr;
+  }
+
+  *size = st.st_size;
+  *inode = st.st_ino;
+  return header;
+}
+
+bool SharedRing::create(const std::string &file, size_t capacity_) {
+  if (memory || !powerOfTwo(capacity_)) {
+    return false;
+  }
+
+  // Readers keep their mapping of the old file, a truncated one would fault under them. They move over to this one
+  // once they notice it replaced the old one.
+  unlink(file.c_str());
+
+  fd = ::open(file.c_str(), O_RDWR | O_CREAT | O_EXCL, 0644);
+  if (fd == -1) {
+    return false;
+  }
+
+  struct stat st;
+  size = sizeof(Header) + capacity_;
+  if (fstat(fd, &st) != 0 || ftruncate(fd, size) != 0) {
+    drop();
+    return false;
+  }
+
+  memory = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (memory == MAP_FAILED) {
+    memory = nullptr;
+    drop();
+    return false;
+  }
+
+  header = static_cast<Header *>(memory);
+  header->version = RING_VERSION;
+  header->capacity = capacity_;
+  header->reserved.store(0);
+  header->head.store(0);
+
+  // Readers check the magic last, so they never see a half written header.
+  std::atomic_thread_fence(std::memory_order_release);
+  header->magic = RING_MAGIC;
+
+  data = static_cast<char *>(memory) + sizeof(Header);
+  capacity = capacity_;
+  path = file;
+  inode = st.st_ino;
+  writable = true;
+  return true;
+}
+
+bool SharedRing::attach(const std::string &file) {
+  if (memory) {
+    return false;
+  }
+
+  const Header *mapped = map(file, &size, &inode);
+  if (!mapped) {
+    return false;
+  }
+
+  memory = const_cast<Header *>(mapped);
+  header = static_cast<Header *>(memory);
+  data = static_cast<char *>(memory) + sizeof(Header);
+  capacity = header->capacity;
+  path = file;
+  return true;
+}
+
+Error SharedRing::publish(const std::string &key, const char *body, size_t length) {
+  Error e;
+
+  uint64_t total = recordSize(key.size(), length);
+  if (!writable || key.size() > UINT16_MAX || total > capacity / 2) {
+    e.context = "Publishing to shared ring";
+    e.type = BROKER_TRANSPORT_ERROR;
+    return e;
+  }
+
+  std::lock_guard<std::mutex> lock(mutex);
+
+  uint64_t position = header->head.load(std::memory_order_relaxed);
+  uint64_t offset = position & (capacity - 1);
+  uint64_t padding = offset + total > capacity ? capacity - offset : 0;
+
+  header->reserved.store(position + padding + total, std::memory_order_relaxed);
+  std::atomic_thread_fence(std::memory_order_release);
+
+  RecordHeader record;
+  if (padding > 0) {
+    record.bodyLength = padding - sizeof(record);
+    record.keyLength = 0;
+    record.flags = RECORD_PADDING;
+    record.sequence = 0;
+    memcpy(data + offset, &record, sizeof(record));
+    offset = 0;
+  }
+
+  record.bodyLength = length;
+  record.keyLength = key.size();
+  record.flags = 0;
+  record.sequence = ++sequence;
+
+  char *out = data + offset;
+  memcpy(out, &record, sizeof(record));
+  memcpy(out + sizeof(record), key.data(), key.size());
+  memcpy(out + sizeof(record) + key.size(), body, length);
+
+  header->head.store(position + padding + total, std::memory_order_release);
+  return e;
+}
+
+std::unique_ptr<Subscription> SharedRing::subscribe(const std::vector<std::string> &keys) {
+  if (!header) {
+    return nullptr;
+  }
+
+  return std::unique_ptr<Subscription>(new Reader(header, data, path, inode, keys));
+}
+
+}  // namespace brokers
+
+}  // namespace spectacles
@@ -0,0 +1,133 @@
+#include <chrono>
+#include <string>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cstring>
+
+#include "../include/session.h"
+
+namespace spectacles {
+
+namespace gateway {
+
+static const uint32_t SESSION_MAGIC = 0x53504353;
+
+static int64_t now() {
+  return std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+}
+
+SessionStore::~SessionStore() {
+  drop();
+}
+
+void SessionStore::drop() {
+  if (layout) {
+    munmap(layout, size);
+    layout = nullptr;
+  }
+
+  if (fd != -1) {
+    close(fd);
+    fd = -1;
+  }
+}
+
+bool SessionStore::open(const std::string &path, int shardCount) {
+  if (fd != -1 || shardCount < 1) {
+    return false;
+  }
+
+  fd = ::open(path.c_str(), O_RDWR | O_CREAT, 0644);
+  if (fd == -1) {
+    return false;
+  }
+
+  size = sizeof(Layout) + (shardCount - 1) * sizeof(Record);
+
+  struct stat st;
+  bool fresh = fstat(fd, &st) != 0 || static_cast<size_t>(st.st_size) != size;
+  if (fresh && (ftruncate(fd, 0) != 0 || ftruncate(fd, size) != 0)) {
+    drop();
+    return false;
+  }
+
+  void *memory = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (memory == MAP_FAILED) {
+    drop();
+    return false;
+  }
+
+  layout = static_cast<Layout *>(memory);
+
+  if (fresh || layout->magic != SESSION_MAGIC || layout->shards != static_cast<uint32_t>(shardCount)) {
+    memset(static_cast<void *>(layout), 0, size);
+    layout->shards = shardCount;
+    layout->magic = SESSION_MAGIC;
+  }
+
+  return true;
+}
+
+SessionStore::Record *SessionStore::record(int shard) {
+  if (!layout || shard < 0 || static_cast<uint32_t>(shard) >= layout->shards) {
+    return nullptr;
+  }
+
+  return &layout->records[shard];
+}
+
+bool SessionStore::load(int shard, int maxAge, std::string *session, int *seq) {
+  Record *r = record(shard);
+  if (!r) {
+    return false;
+  }
+
+  uint32_t length = r->length.load(std::memory_order_acquire);
+  if (length == 0 || length > sizeof(r->session) || now() - r->updated.load() > maxAge) {
+    return false;
+  }
+
+  *session = std::string(r->session, length);
+  *seq = r->seq.load();
+  return true;
+}
+
+void SessionStore::save(int shard, const std::string &session, int seq) {
+  Record *r = record(shard);
+  if (!r || session.size() > sizeof(r->session)) {
+    return;
+  }
+
+  r->length.store(0, std::memory_order_release);
+  memcpy(r->session, session.data(), session.size());
+  r->seq.store(seq);
+  r->updated.store(now());
+  r->length.store(session.size(), std::memory_order_release);
+
+  msync(layout, size, MS_ASYNC);
+}
+
+void SessionStore::update(int shard, int seq) {
+  Record *r = record(shard);
+  if (!r) {
+    return;
+  }
+
+  r->seq.store(seq, std::memory_order_relaxed);
+  r->updated.store(now(), std::memory_order_relaxed);
+}
+
+void SessionStore::clear(int shard) {
+  Record *r = record(shard);
+  if (r) {
+    r->length.store(0, std::memory_order_release);
+  }
+}
+
+}  // namespace gateway
+
+}  // namespace spectacles
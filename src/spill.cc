@@ -0,0 +1,387 @@
+#include <algorithm>
+#include <chrono>
+#include <string>
+#include <vector>
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#include "../include/spill.h"
+
+namespace spectacles {
+
+namespace brokers {
+
+static const uint32_t SPILL_MAGIC = 0x53505350;
+static const uint32_t SPILL_VERSION = 1;
+
+struct RecordHeader {
+  uint32_t keyLength;
+  uint32_t bodyLength;
+};
+
+static size_t recordSize(size_t keyLength, size_t bodyLength) {
+  return (sizeof(RecordHeader) + keyLength + bodyLength + 7) & ~static_cast<size_t>(7);
+}
+
+// Reads the header of the record at offset, returning the record's size or 0 if it runs past end.
+static size_t readRecord(const char *memory, size_t offset, size_t end, RecordHeader *out) {
+  if (offset > end || end - offset < sizeof(RecordHeader)) {
+    return 0;
+  }
+
+  memcpy(out, memory + offset, sizeof(RecordHeader));
+  size_t size = recordSize(out->keyLength, out->bodyLength);
+  return size <= end - offset ? size : 0;
+}
+
+SpillQueue::SpillQueue(size_t capacity, size_t segmentSize_) : ring(std::max(capacity, static_cast<size_t>(1))), segmentSize(segmentSize_) { }
+
+SpillQueue::~SpillQueue() {
+  std::lock_guard<std::mutex> lock(mutex);
+  persist();
+
+  for (Segment &segment : segments) {
+    unmap(&segment, false);
+  }
+}
+
+std::string SpillQueue::path(uint64_t index) const {
+  char name[32];
+  snprintf(name, sizeof(name), "%020llu.spill", static_cast<unsigned long long>(index));
+  return directory + "/" + name;
+}
+
+bool SpillQueue::map(Segment *segment, bool create) {
+  std::string file = path(segment->index);
+  segment->fd = ::open(file.c_str(), create ? O_RDWR | O_CREAT | O_EXCL : O_RDWR, 0644);
+  if (segment->fd == -1) {
+    return false;
+  }
+
+  struct stat st;
+  if (create) {
+    if (ftruncate(segment->fd, segment->size) != 0) {
+      ::close(segment->fd);
+      unlink(file.c_str());
+      return false;
+    }
+  } else if (fstat(segment->fd, &st) != 0 || static_cast<size_t>(st.st_size) < sizeof(SegmentHeader)) {
+    ::close(segment->fd);
+    return false;
+  } else {
+    segment->size = st.st_size;
+  }
+
+  void *memory = mmap(nullptr, segment->size, PROT_READ | PROT_WRITE, MAP_SHARED, segment->fd, 0);
+  if (memory == MAP_FAILED) {
+    ::close(segment->fd);
+    return false;
+  }
+
+  segment->memory = static_cast<char *>(memory);
+  SegmentHeader *header = reinterpret_cast<SegmentHeader *>(segment->memory);
+
+  if (create) {
+    header->magic = SPILL_MAGIC;
+    header->version = SPILL_VERSION;
+    header->end = sizeof(SegmentHeader);
+    header->read = sizeof(SegmentHeader);
+  } else if (header->magic != SPILL_MAGIC || header->version != SPILL_VERSION || header->end > segment->size
+      || header->read > header->end) {
+    unmap(segment, false);
+    return false;
+  }
+
+  return true;
+}
+
+bool SpillQueue::append(Segment *segment, const std::string &key, const std::string &body) {
+  SegmentHeader *header = reinterpret_cast<SegmentHeader *>(segment->memory);
+  size_t size = recordSize(key.size(), body.size());
+  if (header->end + size > segment->size) {
+    return false;
+  }
+
+  RecordHeader record;
+  record.keyLength = key.size();
+  record.bodyLength = body.size();
+
+  char *out = segment->memory + header->end;
+  memcpy(out, &record, sizeof(record));
+  memcpy(out + sizeof(record), key.data(), key.size());
+  memcpy(out + sizeof(record) + key.size(), body.data(), body.size());
+
+  header->end += size;
+  segment->records++;
+  return true;
+}
+
+void SpillQueue::unmap(Segment *segment, bool remove) {
+  munmap(segment->memory, segment->size);
+  ::close(segment->fd);
+
+  if (remove) {
+    unlink(path(segment->index).c_str());
+  }
+}
+
+// Drops the front segment along with whatever is left in it.
+void SpillQueue::discard() {
+  taken += segments.front().records;
+  onDisk -= segments.front().records;
+  unmap(&segments.front(), true);
+  segments.pop_front();
+}
+
+bool SpillQueue::spill(const std::string &key, const std::string &body) {
+  if (directory.empty()) {
+    return false;
+  }
+
+  if (segments.empty() || !append(&segments.back(), key, body)) {
+    Segment segment;
+    segment.index = nextIndex++;
+    segment.size = std::max(segmentSize, sizeof(SegmentHeader) + recordSize(key.size(), body.size()));
+    if (!map(&segment, true)) {
+      return false;
+    }
+
+    segments.push_back(segment);
+    append(&segments.back(), key, body);
+  }
+
+  onDisk++;
+  return true;
+}
+
+// Writes the ring out ahead of every segment, as everything in memory is older than what is on disk.
+void SpillQueue::persist() {
+  if (directory.empty() || count == 0) {
+    return;
+  }
+
+  size_t total = sizeof(SegmentHeader);
+  for (size_t i = 0; i < count; i++) {
+    const Message &m = ring[(head + i) % ring.size()];
+    total += recordSize(m.key.size(), m.body.size());
+  }
+
+  Segment segment;
+  segment.index = segments.empty() ? nextIndex++ : segments.front().index - 1;
+  segment.size = total;
+  if (!map(&segment, true)) {
+    return;
+  }
+
+  for (size_t i = 0; i < count; i++) {
+    const Message &m = ring[(head + i) % ring.size()];
+    append(&segment, m.key, m.body);
+  }
+
+  msync(segment.memory, segment.size, MS_SYNC);
+  unmap(&segment, false);
+  count = 0;
+}
+
+bool SpillQueue::open(const std::string &dir) {
+  std::lock_guard<std::mutex> lock(mutex);
+
+  if (!directory.empty() || (mkdir(dir.c_str(), 0755) != 0 && errno != EEXIST)) {
+    return false;
+  }
+
+  DIR *d = opendir(dir.c_str());
+  if (!d) {
+    return false;
+  }
+
+  std::vector<uint64_t> indices;
+  while (struct dirent *entry = readdir(d)) {
+    std::string name(entry->d_name);
+    if (name.size() == 26 && name.compare(20, 6, ".spill") == 0) {
+      indices.push_back(strtoull(name.c_str(), nullptr, 10));
+    }
+  }
+  closedir(d);
+
+  std::sort(indices.begin(), indices.end());
+  directory = dir;
+
+  for (uint64_t index : indices) {
+    Segment segment;
+    segment.index = index;
+    if (!map(&segment, false)) {
+      continue;
+    }
+
+    // Anything past the last whole record is cut off, so appending to the segment overwrites it.
+    SegmentHeader *header = reinterpret_cast<SegmentHeader *>(segment.memory);
+    size_t offset = header->read;
+    RecordHeader record;
+    while (size_t size = readRecord(segment.memory, offset, header->end, &record)) {
+      offset += size;
+      segment.records++;
+    }
+    header->end = offset;
+
+    if (segment.records == 0) {
+      unmap(&segment, true);
+      continue;
+    }
+
+    onDisk += segment.records;
+    segments.push_back(segment);
+    nextIndex = std::max(nextIndex, index + 1);
+  }
+
+  if (onDisk > 0) {
+    ready.notify_one();
+  }
+
+  return true;
+}
+
+bool SpillQueue::push(std::string key, std::string body) {
+  bool kept = true;
+
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+
+    if (!segments.empty() || count == ring.size()) {
+      if (spill(key, body)) {
+        ready.notify_one();
+        return true;
+      }
+
+      // Behind records already on disk the message has nowhere to go without breaking order.
+      if (!segments.empty()) {
+        return false;
+      }
+    }
+
+    if (count == ring.size()) {
+      head = (head + 1) % ring.size();
+      count--;
+      taken++;
+      kept = false;
+    }
+
+    Message &m = ring[(head + count) % ring.size()];
+    m.key = std::move(key);
+    m.body = std::move(body);
+    count++;
+  }
+
+  ready.notify_one();
+  return kept;
+}
+
+bool SpillQueue::front(Message *out, uint64_t *position, int timeout) {
+  std::unique_lock<std::mutex> lock(mutex);
+
+  if (!ready.wait_for(lock, std::chrono::milliseconds(timeout), [this]() { return closed || count > 0 || onDisk > 0; })) {
+    return false;
+  }
+
+  if (closed) {
+    return false;
+  }
+
+  if (count > 0) {
+    *out = ring[head];
+    *position = taken;
+    return true;
+  }
+
+  // Every segment but the last one being written is deleted as soon as it is drained, and one whose records no longer
+  // fit in it has been changed under us, so it is dropped rather than read out of bounds.
+  while (!segments.empty()) {
+    const Segment &segment = segments.front();
+    const SegmentHeader *header = reinterpret_cast<const SegmentHeader *>(segment.memory);
+
+    RecordHeader record;
+    if (readRecord(segment.memory, header->read, header->end, &record) == 0) {
+      discard();
+      continue;
+    }
+
+    const char *data = segment.memory + header->read + sizeof(record);
+    out->key.assign(data, record.keyLength);
+    out->body.assign(data + record.keyLength, record.bodyLength);
+    *position = taken;
+    return true;
+  }
+
+  return false;
+}
+
+void SpillQueue::pop(uint64_t position) {
+  std::lock_guard<std::mutex> lock(mutex);
+
+  if (position != taken) {
+    return;
+  }
+
+  if (count > 0) {
+    ring[head] = Message();
+    head = (head + 1) % ring.size();
+    count--;
+    taken++;
+    return;
+  }
+
+  if (onDisk == 0) {
+    return;
+  }
+
+  Segment &segment = segments.front();
+  SegmentHeader *header = reinterpret_cast<SegmentHeader *>(segment.memory);
+
+  RecordHeader record;
+  size_t size = readRecord(segment.memory, header->read, header->end, &record);
+  if (size == 0) {
+    discard();
+    return;
+  }
+
+  header->read += size;
+  segment.records--;
+  onDisk--;
+  taken++;
+
+  if (header->read >= header->end) {
+    discard();
+  }
+}
+
+void SpillQueue::close() {
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    closed = true;
+  }
+
+  ready.notify_all();
+}
+
+size_t SpillQueue::size() const {
+  std::lock_guard<std::mutex> lock(mutex);
+  return count + onDisk;
+}
+
+size_t SpillQueue::spilled() const {
+  std::lock_guard<std::mutex> lock(mutex);
+  return onDisk;
+}
+
+}  // namespace brokers
+
+}  // namespace spectacles
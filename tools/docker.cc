@@ -3,6 +3,7 @@
 
 #include <cstdlib>
 #include <chrono>
+#include <memory>
 #include <set>
 #include <string>
 #include <sstream>
@@ -22,31 +23,178 @@ int main() {
     publisherEvents.insert(substr);
   }
 
+  gateway::SessionStore sessions;
+  bool persistSessions = false;
+
+  metrics::Registry *registry = nullptr;
+  if (std::getenv("METRICS_PORT")) {
+    metrics::Server server;
+    if (!server.listen(atoi(std::getenv("METRICS_PORT")))) {
+      std::cerr << "Failed to listen for metrics on port " << std::getenv("METRICS_PORT") << std::endl;
+      exit(1);
+    }
+
+    registry = &metrics::Registry::global();
+  }
+
+  gateway::Recorder recorder;
+  bool record = false;
+  if (std::getenv("RECORD_FILE")) {
+    record = recorder.open(std::getenv("RECORD_FILE"));
+    if (!record) {
+      std::cerr << "Failed to open " << std::getenv("RECORD_FILE") << " for recording" << std::endl;
+      exit(1);
+    }
+  }
+
+  // Lets other processes on the host read guild state straight from shared memory.
+  cache::SharedStore sharedCache;
+  cache::Store *stateCache = nullptr;
+  if (std::getenv("CACHE_FILE")) {
+    if (!sharedCache.create(std::getenv("CACHE_FILE"))) {
+      std::cerr << "Failed to create the cache at " << std::getenv("CACHE_FILE") << std::endl;
+      exit(1);
+    }
+
+    stateCache = &sharedCache;
+  }
+
+  // Lets consumers on the same host take dispatches straight from shared memory instead of from the broker.
+  brokers::SharedRing sharedRing;
+  brokers::Transport *transport = nullptr;
+  if (std::getenv("RING_FILE")) {
+    if (!sharedRing.create(std::getenv("RING_FILE"))) {
+      std::cerr << "Failed to create the ring at " << std::getenv("RING_FILE") << std::endl;
+      exit(1);
+    }
+
+    transport = &sharedRing;
+  }
+
+  // Each shard publishes through its own Publisher, which is not thread safe, or through its own channel of the shared
+  // PublisherPool, so dispatches stay ordered per shard.
+  std::unique_ptr<DispatchPool> pool;
+  if (std::getenv("DISPATCH_THREADS")) {
+    pool.reset(new DispatchPool(atoi(std::getenv("DISPATCH_THREADS"))));
+  }
+
   if (std::getenv("SHARDS")) {
     int shardCount = atoi(std::getenv("SHARDS"));
+
+    if (std::getenv("SESSION_FILE")) {
+      persistSessions = sessions.open(std::getenv("SESSION_FILE"), shardCount);
+    }
+
+    // With PUBLISHER_CONNECTIONS every shard shares a few connections instead of opening one each. The pool has none of
+    // the Publisher's batching, compression, spilling, pipelining or ring transport, so asking for them is an error
+    // rather than something to silently drop.
+    std::unique_ptr<brokers::PublisherPool> publisherPool;
+    if (std::getenv("PUBLISHER_CONNECTIONS")) {
+      for (const char *option : {"BATCH_BYTES", "COMPRESS_THRESHOLD", "SPILL_DIR", "PIPELINE_WINDOW", "RING_FILE"}) {
+        if (std::getenv(option)) {
+          std::cerr << option << " cannot be combined with PUBLISHER_CONNECTIONS" << std::endl;
+          exit(1);
+        }
+      }
+
+      int channels = std::getenv("PUBLISHER_CHANNELS") ? atoi(std::getenv("PUBLISHER_CHANNELS")) : 4;
+      publisherPool.reset(new brokers::PublisherPool(atoi(std::getenv("PUBLISHER_CONNECTIONS")), channels));
+      publisherPool->useMetrics(registry);
+
+      if (std::getenv("PARTITIONS")) {
+        publisherPool->partition(atoi(std::getenv("PARTITIONS")));
+      }
+
+      while (true) {
+        brokers::Error e = publisherPool->connect(std::getenv("HOST"), atoi(std::getenv("PORT")), std::getenv("PUBLISHER_GROUP"), publisherEvents);
+        if (e.type == brokers::BROKER_OK) {
+          break;
+        } else if (e.type == brokers::BROKER_AMQP_STATUS_ERROR && e.amqpStatus == AMQP_STATUS_SOCKET_ERROR ) {
+          std::cout << "Failed to connect to TCP socket, retrying in 5 seconds..." << std::endl;
+          std::this_thread::sleep_for(std::chrono::seconds(5));
+        } else {
+          std::cerr << "Unexpected publisher connect error " << e.type << " while " << e.context << std::endl;
+          exit(1);
+        }
+      }
+    }
+
     std::vector<std::string> consumerEvents(shardCount);
     std::vector<gateway::Connection> shards(shardCount);
 
     for (int i = 0; i < shardCount; i++) {
       consumerEvents.push_back(std::to_string(i));
-      std::thread([i, shardCount, &shards, &publisherEvents]() {
-        gateway::Connection conn;
-        shards[i] = conn;
+      std::thread([i, shardCount, &shards, &publisherEvents, &publisherPool, &sessions, persistSessions, registry, &pool, &recorder, record, stateCache, transport]() {
+        gateway::Connection &conn = shards[i];
 
         brokers::Publisher publisher;
-        publisher.connect(std::getenv("HOST"), atoi(std::getenv("PORT")), std::getenv("PUBLISHER_GROUP"), publisherEvents);
-
-        while (true) {
-          brokers::Error e = publisher.connect(std::getenv("HOST"), atoi(std::getenv("PORT")), std::getenv("PUBLISHER_GROUP"), publisherEvents);
-          if (e.type == brokers::BROKER_OK) {
-            break;
-          } else if (e.type == brokers::BROKER_AMQP_STATUS_ERROR && e.amqpStatus == AMQP_STATUS_SOCKET_ERROR ) {
-            std::cout << "[SHARD: " << i << "] Failed to connect to TCP socket, retrying in 5 seconds..." << std::endl;
-            std::this_thread::sleep_for(std::chrono::seconds(5));
-          } else {
-            std::cerr << "[SHARD: " << i << "] Unexpected publisher connect error " << e.type << " while " << e.context << std::endl;
+        std::function<void(gateway::Packet)> publish;
+
+        if (publisherPool) {
+          publish = [&publisherPool, i](gateway::Packet p) {
+            publisherPool->publish(gateway::PacketView(&p), i);
+          };
+        } else if (transport) {
+          publisher.useMetrics(registry);
+          publisher.useTransport(transport);
+
+          if (std::getenv("BATCH_BYTES")) {
+            publisher.batch(atoi(std::getenv("BATCH_BYTES")), std::getenv("BATCH_DELAY") ? atoi(std::getenv("BATCH_DELAY")) : 10);
+          }
+
+          if (std::getenv("COMPRESS_THRESHOLD")) {
+            publisher.compress(atoi(std::getenv("COMPRESS_THRESHOLD")));
+          }
+
+          if (std::getenv("PARTITIONS")) {
+            publisher.partition(atoi(std::getenv("PARTITIONS")));
+          }
+
+          publish = [&publisher](gateway::Packet p) {
+            publisher.publish(p);
+          };
+        } else {
+          publisher.useMetrics(registry);
+          publisher.connect(std::getenv("HOST"), atoi(std::getenv("PORT")), std::getenv("PUBLISHER_GROUP"), publisherEvents);
+
+          while (true) {
+            brokers::Error e = publisher.connect(std::getenv("HOST"), atoi(std::getenv("PORT")), std::getenv("PUBLISHER_GROUP"), publisherEvents);
+            if (e.type == brokers::BROKER_OK) {
+              break;
+            } else if (e.type == brokers::BROKER_AMQP_STATUS_ERROR && e.amqpStatus == AMQP_STATUS_SOCKET_ERROR ) {
+              std::cout << "[SHARD: " << i << "] Failed to connect to TCP socket, retrying in 5 seconds..." << std::endl;
+              std::this_thread::sleep_for(std::chrono::seconds(5));
+            } else {
+              std::cerr << "[SHARD: " << i << "] Unexpected publisher connect error " << e.type << " while " << e.context << std::endl;
+              exit(1);
+            }
+          }
+
+          if (std::getenv("SPILL_DIR") && !publisher.spill(std::string(std::getenv("SPILL_DIR")) + "/" + std::to_string(i))) {
+            std::cerr << "[SHARD: " << i << "] Failed to open " << std::getenv("SPILL_DIR") << " for spilling" << std::endl;
+            exit(1);
+          }
+
+          if (std::getenv("PIPELINE_WINDOW") && !publisher.pipeline(atoi(std::getenv("PIPELINE_WINDOW")))) {
+            std::cerr << "[SHARD: " << i << "] Failed to start pipelining" << std::endl;
             exit(1);
           }
+
+          if (std::getenv("BATCH_BYTES")) {
+            publisher.batch(atoi(std::getenv("BATCH_BYTES")), std::getenv("BATCH_DELAY") ? atoi(std::getenv("BATCH_DELAY")) : 10);
+          }
+
+          if (std::getenv("COMPRESS_THRESHOLD")) {
+            publisher.compress(atoi(std::getenv("COMPRESS_THRESHOLD")));
+          }
+
+          if (std::getenv("PARTITIONS")) {
+            publisher.partition(atoi(std::getenv("PARTITIONS")));
+          }
+
+          publish = [&publisher](gateway::Packet p) {
+            publisher.publish(p);
+          };
         }
 
         conn.onError([i]() {
@@ -61,22 +209,68 @@ int main() {
           std::cout << "[SHARD: " << i << "] Disconnected: " << code << std::endl;
         });
 
-        conn.onMessage([&publisher](gateway::Packet p) {
-          publisher.publish(p);
+        std::unique_ptr<PresenceCoalescer> coalescer;
+        if (std::getenv("PRESENCE_WINDOW")) {
+          coalescer.reset(new PresenceCoalescer(atoi(std::getenv("PRESENCE_WINDOW"))));
+          coalescer->useMetrics(registry);
+          coalescer->onMessage([&publish](gateway::Packet p) {
+            publish(std::move(p));
+          });
+        }
+
+        conn.onMessage([&publish, &coalescer](gateway::Packet p) {
+          if (coalescer) {
+            coalescer->push(std::move(p));
+          } else {
+            publish(std::move(p));
+          }
         });
 
         gateway::Options opt;
         opt.token = std::getenv("TOKEN");
+
+        if (std::getenv("GATEWAY_URL")) {
+          opt.url = std::getenv("GATEWAY_URL");
+        }
         opt.shard_id = i;
         opt.shard_count = shardCount;
 
+        if (persistSessions) {
+          opt.session_store = &sessions;
+        }
+
+        opt.metrics = registry;
+        opt.dispatch_pool = pool.get();
+        opt.defer_dispatches = std::getenv("DEFER_DISPATCHES") != nullptr;
+
+        if (record) {
+          opt.recorder = &recorder;
+        }
+
+        opt.cache = stateCache;
+
         conn.connect(opt);
       }).detach();
 
       std::this_thread::sleep_for(std::chrono::seconds(6));
     }
 
+    std::unique_ptr<DispatchPool> consumerPool;
+    if (std::getenv("CONSUMER_THREADS")) {
+      consumerPool.reset(new DispatchPool(atoi(std::getenv("CONSUMER_THREADS"))));
+    }
+
     brokers::Consumer consumer;
+    consumer.useMetrics(registry);
+
+    if (std::getenv("CONSUMER_PREFETCH")) {
+      consumer.acknowledge(atoi(std::getenv("CONSUMER_PREFETCH")));
+    }
+
+    consumer.useDispatchPool(consumerPool.get());
+
+    // Commands are forwarded to the gateway as they are, so they never need decoding.
+    consumer.decodeLazily();
 
     consumer.onError([&consumer, consumerEvents](brokers::Error e) {
       if (e.type == brokers::BROKER_OK) {
@@ -91,7 +285,7 @@ int main() {
       }
     });
 
-    consumer.onMessage([&shards](std::string event, gateway::Packet p) {
+    consumer.onMessage([&shards](const std::string &event, const gateway::PacketView &p) {
       shards[atoi(event.c_str())].send(p.raw, p.length);
     });
 
@@ -104,6 +298,7 @@ int main() {
     gateway::Connection conn;
 
     brokers::Publisher publisher;
+    publisher.useMetrics(registry);
 
     while (true) {
       brokers::Error e = publisher.connect(std::getenv("HOST"), atoi(std::getenv("PORT")), std::getenv("PUBLISHER_GROUP"), publisherEvents);
@@ -118,16 +313,53 @@ int main() {
       }
     }
 
+    if (std::getenv("SPILL_DIR") && !publisher.spill(std::string(std::getenv("SPILL_DIR")) + "/" + std::getenv("SHARD_ID"))) {
+      std::cerr << "Failed to open " << std::getenv("SPILL_DIR") << " for spilling" << std::endl;
+      exit(1);
+    }
+
+    if (std::getenv("PIPELINE_WINDOW") && !publisher.pipeline(atoi(std::getenv("PIPELINE_WINDOW")))) {
+      std::cerr << "Failed to start pipelining" << std::endl;
+      exit(1);
+    }
+
+    if (std::getenv("BATCH_BYTES")) {
+      publisher.batch(atoi(std::getenv("BATCH_BYTES")), std::getenv("BATCH_DELAY") ? atoi(std::getenv("BATCH_DELAY")) : 10);
+    }
+
+    if (std::getenv("COMPRESS_THRESHOLD")) {
+      publisher.compress(atoi(std::getenv("COMPRESS_THRESHOLD")));
+    }
+
+    if (std::getenv("PARTITIONS")) {
+      publisher.partition(atoi(std::getenv("PARTITIONS")));
+    }
+
     std::vector<std::string> consumerEvents = {std::getenv("SHARD_ID")};
+    std::unique_ptr<DispatchPool> consumerPool;
+    if (std::getenv("CONSUMER_THREADS")) {
+      consumerPool.reset(new DispatchPool(atoi(std::getenv("CONSUMER_THREADS"))));
+    }
+
     brokers::Consumer consumer;
+    consumer.useMetrics(registry);
+
+    if (std::getenv("CONSUMER_PREFETCH")) {
+      consumer.acknowledge(atoi(std::getenv("CONSUMER_PREFETCH")));
+    }
+
+    consumer.useDispatchPool(consumerPool.get());
+
+    // Commands are forwarded to the gateway as they are, so they never need decoding.
+    consumer.decodeLazily();
 
     consumer.onError([](brokers::Error e) {
       std::cerr << "Unexpected consumer error " << e.type << " while " << e.context << std::endl;
       exit(1);
     });
 
-    consumer.onMessage([&conn](std::string event, gateway::Packet p) {
-      conn.send(p);
+    consumer.onMessage([&conn](const std::string &event, const gateway::PacketView &p) {
+      conn.send(p.raw, p.length);
     });
 
     consumer.connect(std::getenv("HOST"), atoi(std::getenv("PORT")), std::getenv("CONSUMER_GROUP"), consumerEvents);
@@ -144,15 +376,46 @@ int main() {
       std::cout << "Disconnected: " << code << std::endl;
     });
 
-    conn.onMessage([&publisher](gateway::Packet p) {
-      publisher.publish(p);
+    std::unique_ptr<PresenceCoalescer> coalescer;
+    if (std::getenv("PRESENCE_WINDOW")) {
+      coalescer.reset(new PresenceCoalescer(atoi(std::getenv("PRESENCE_WINDOW"))));
+      coalescer->useMetrics(registry);
+      coalescer->onMessage([&publisher](gateway::Packet p) {
+        publisher.publish(p);
+      });
+    }
+
+    conn.onMessage([&publisher, &coalescer](gateway::Packet p) {
+      if (coalescer) {
+        coalescer->push(std::move(p));
+      } else {
+        publisher.publish(p);
+      }
     });
 
     gateway::Options opt;
     opt.token = std::getenv("TOKEN");
+
+    if (std::getenv("GATEWAY_URL")) {
+      opt.url = std::getenv("GATEWAY_URL");
+    }
     opt.shard_id = atoi(std::getenv("SHARD_ID"));
     opt.shard_count = atoi(std::getenv("SHARD_COUNT"));
 
+    if (std::getenv("SESSION_FILE") && sessions.open(std::getenv("SESSION_FILE"), opt.shard_count)) {
+      opt.session_store = &sessions;
+    }
+
+    opt.metrics = registry;
+    opt.dispatch_pool = pool.get();
+    opt.defer_dispatches = std::getenv("DEFER_DISPATCHES") != nullptr;
+
+    if (record) {
+      opt.recorder = &recorder;
+    }
+
+    opt.cache = stateCache;
+
     conn.connect(opt);
   }
 }
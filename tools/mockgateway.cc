@@ -0,0 +1,244 @@
+#include <iostream>
+#include "../include/spectacles.h"
+
+#include <cstdlib>
+#include <map>
+#include <random>
+#include <string>
+#include <sstream>
+#include <vector>
+
+#include <uWS/uWS.h>
+
+using namespace spectacles;
+
+// A local stand-in for the Discord gateway, for load and reconnect testing without touching Discord.
+//
+// It answers HELLO, IDENTIFY, RESUME and HEARTBEAT like the real gateway, then streams MESSAGE_CREATE dispatches
+// to every identified connection. Point a Connection at it with Options#url, e.g. ws://localhost:8080.
+//
+//   PORT               - The port to listen on (8080).
+//   RATE               - Dispatches per second per connection (1000).
+//   SIZES              - Comma separated approximate dispatch sizes in bytes, picked at random (256,1024,8192).
+//   GUILDS             - The number of distinct guild IDs to spread dispatches over (16).
+//   HEARTBEAT_INTERVAL - The heartbeat interval sent in HELLO, in milliseconds (41250).
+//   CLOSE_EVERY        - Close each connection after this many dispatches, 0 to never close (0).
+//   CLOSE_CODE         - The close code used by CLOSE_EVERY (4000).
+
+static const int TICK = 10;
+
+struct Client {
+  uWS::WebSocket<uWS::SERVER> *ws = nullptr;
+  uS::Timer *timer = nullptr;
+  std::string session;
+  int seq = 0;
+  uint64_t sent = 0;
+  double owed = 0;
+};
+
+static int rate = 1000;
+static int heartbeatInterval = 41250;
+static uint64_t closeEvery = 0;
+static int closeCode = 4000;
+
+static std::vector<std::string> templates;
+static std::map<std::string, int> sessions;
+static std::mt19937 rng;
+static etf::erlpack_buffer frame = {nullptr, 0, 0};
+static uint64_t totalFrames = 0;
+static uint64_t totalBytes = 0;
+static int nextSession = 0;
+
+static int env(const char *name, int fallback) {
+  return std::getenv(name) ? atoi(std::getenv(name)) : fallback;
+}
+
+static std::string encode(etf::Data d) {
+  etf::Encoder encoder;
+  encoder.pack(d);
+
+  etf::out_buf buf = encoder.release();
+  std::string frame(buf.buf, buf.length);
+  free(buf.buf);
+  return frame;
+}
+
+static void send(Client *client, const std::string &message) {
+  client->ws->send(message.data(), message.size(), uWS::BINARY);
+}
+
+// Builds every dispatch from a pre-encoded d so that streaming costs a copy rather than a full encode.
+static void dispatch(Client *client, const char *t, const std::string &d) {
+  client->seq++;
+
+  frame.length = 0;
+  etf::erlpack_append_version(&frame);
+  etf::erlpack_append_map_header(&frame, 4);
+  etf::erlpack_append_binary(&frame, "op", 2);
+  etf::erlpack_append_small_integer(&frame, 0);
+  etf::erlpack_append_binary(&frame, "s", 1);
+  etf::erlpack_append_integer(&frame, client->seq);
+  etf::erlpack_append_binary(&frame, "t", 1);
+  etf::erlpack_append_binary(&frame, t, strlen(t));
+
+  etf::erlpack_append_binary(&frame, "d", 1);
+  etf::erlpack_buffer_write(&frame, d.data() + 1, d.size() - 1);
+
+  client->ws->send(frame.buf, frame.length, uWS::BINARY);
+  totalFrames++;
+  totalBytes += frame.length;
+}
+
+static void stream(uS::Timer *timer) {
+  Client *client = static_cast<Client *>(timer->getData());
+
+  client->owed += rate * TICK / 1000.0;
+  while (client->owed >= 1) {
+    client->owed--;
+    dispatch(client, "MESSAGE_CREATE", templates[rng() % templates.size()]);
+
+    if (closeEvery && ++client->sent % closeEvery == 0) {
+      client->owed = 0;
+      client->ws->close(closeCode);
+      return;
+    }
+  }
+}
+
+static void start(Client *client, uS::Loop *loop) {
+  if (client->timer) {
+    return;
+  }
+
+  client->timer = new uS::Timer(loop);
+  client->timer->setData(client);
+  client->timer->start(stream, TICK, TICK);
+}
+
+static void receive(Client *client, uS::Loop *loop, char *message, size_t length) {
+  etf::Header header;
+  if (!etf::Scanner(message, length).header(&header)) {
+    client->ws->close(4002);
+    return;
+  }
+
+  if (header.op == 1) {
+    etf::Data ack = etf::Data::Object();
+    ack["op"] = 11;
+    send(client, encode(ack));
+  } else if (header.op == 2) {
+    client->session = "mock" + std::to_string(nextSession++);
+    client->seq = 0;
+
+    etf::Data ready = etf::Data::Object();
+    ready["v"] = 6;
+    ready["session_id"] = client->session;
+    ready["user"] = etf::Data::Object();
+    ready["user"]["id"] = "1";
+    ready["user"]["username"] = "mock";
+    ready["guilds"] = etf::Data::Array(0);
+    dispatch(client, "READY", encode(ready));
+
+    start(client, loop);
+  } else if (header.op == 6) {
+    etf::Scanner d(header.d.data, header.d.length, true);
+    etf::Slice session;
+
+    auto it = sessions.end();
+    if (d.find("session_id") && d.string(&session)) {
+      it = sessions.find(session.str());
+    }
+
+    if (it == sessions.end()) {
+      etf::Data invalid = etf::Data::Object();
+      invalid["op"] = 9;
+      invalid["d"] = false;
+      send(client, encode(invalid));
+      return;
+    }
+
+    client->session = it->first;
+    client->seq = it->second;
+    sessions.erase(it);
+
+    dispatch(client, "RESUMED", encode(etf::Data::Object()));
+
+    start(client, loop);
+  }
+}
+
+int main() {
+  rate = env("RATE", rate);
+  heartbeatInterval = env("HEARTBEAT_INTERVAL", heartbeatInterval);
+  closeEvery = env("CLOSE_EVERY", 0);
+  closeCode = env("CLOSE_CODE", closeCode);
+
+  std::vector<int> sizes;
+  std::stringstream ss(std::getenv("SIZES") ? std::getenv("SIZES") : "256,1024,8192");
+  while (ss.good()) {
+    std::string substr;
+    std::getline(ss, substr, ',');
+    sizes.push_back(atoi(substr.c_str()));
+  }
+
+  int guilds = env("GUILDS", 16);
+  for (int size : sizes) {
+    for (int g = 0; g < guilds; g++) {
+      etf::Data message = etf::Data::Object();
+      message["id"] = std::to_string(500000000000000000ULL + templates.size());
+      message["guild_id"] = std::to_string(100000000000000000ULL + g);
+      message["channel_id"] = std::to_string(200000000000000000ULL + g);
+      message["content"] = std::string(size > 128 ? size - 128 : 0, 'x');
+      templates.push_back(encode(message));
+    }
+  }
+
+  uWS::Hub hub;
+  uS::Loop *loop = hub.getLoop();
+
+  hub.onConnection([](uWS::WebSocket<uWS::SERVER> *ws, uWS::HttpRequest req) {
+    Client *client = new Client();
+    client->ws = ws;
+    ws->setUserData(client);
+
+    etf::Data hello = etf::Data::Object();
+    hello["op"] = 10;
+    hello["d"] = etf::Data::Object();
+    hello["d"]["heartbeat_interval"] = heartbeatInterval;
+    send(client, encode(hello));
+  });
+
+  hub.onMessage([loop](uWS::WebSocket<uWS::SERVER> *ws, char *message, size_t length, uWS::OpCode opCode) {
+    receive(static_cast<Client *>(ws->getUserData()), loop, message, length);
+  });
+
+  hub.onDisconnection([](uWS::WebSocket<uWS::SERVER> *ws, int code, char *message, size_t length) {
+    Client *client = static_cast<Client *>(ws->getUserData());
+
+    if (client->timer) {
+      client->timer->stop();
+      client->timer->close();
+    }
+
+    // Keep the session resumable, as Discord does after most disconnects.
+    if (!client->session.empty()) {
+      sessions[client->session] = client->seq;
+    }
+
+    delete client;
+  });
+
+  uS::Timer *report = new uS::Timer(loop);
+  report->start([](uS::Timer *timer) {
+    std::cout << "Sent " << totalFrames << " dispatches (" << totalBytes << " bytes)" << std::endl;
+  }, 10000, 10000);
+
+  int port = env("PORT", 8080);
+  if (!hub.listen(port)) {
+    std::cerr << "Failed to listen on port " << port << std::endl;
+    exit(1);
+  }
+
+  std::cout << "Mock gateway listening on port " << port << std::endl;
+  hub.run();
+}
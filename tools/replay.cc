@@ -0,0 +1,64 @@
+#include <iostream>
+#include "../include/spectacles.h"
+
+#include <cstdlib>
+#include <chrono>
+#include <set>
+#include <string>
+#include <sstream>
+
+using namespace spectacles;
+
+// Replays a log written with RECORD_FILE through a Publisher, for load testing and profiling without Discord.
+int main() {
+  if (!std::getenv("REPLAY_FILE")) {
+    std::cerr << "REPLAY_FILE is required" << std::endl;
+    exit(1);
+  }
+
+  std::set<std::string> publisherEvents;
+  if (std::getenv("EVENTS")) {
+    std::stringstream ss(std::getenv("EVENTS"));
+
+    while (ss.good()) {
+      std::string substr;
+      std::getline(ss, substr, ',');
+      publisherEvents.insert(substr);
+    }
+  }
+
+  // 0 replays as fast as possible, 1 at the recorded pace.
+  double speed = std::getenv("SPEED") ? atof(std::getenv("SPEED")) : 1;
+  int loops = std::getenv("LOOPS") ? atoi(std::getenv("LOOPS")) : 1;
+
+  gateway::Replayer replayer;
+  if (!replayer.open(std::getenv("REPLAY_FILE"))) {
+    std::cerr << "Failed to open " << std::getenv("REPLAY_FILE") << std::endl;
+    exit(1);
+  }
+
+  brokers::Publisher publisher;
+  brokers::Error e = publisher.connect(std::getenv("HOST"), atoi(std::getenv("PORT")), std::getenv("PUBLISHER_GROUP"), publisherEvents);
+  if (e.type != brokers::BROKER_OK) {
+    std::cerr << "Unexpected publisher connect error " << e.type << " while " << e.context << std::endl;
+    exit(1);
+  }
+
+  size_t frames = 0;
+  size_t bytes = 0;
+  auto start = std::chrono::steady_clock::now();
+
+  for (int i = 0; i < loops; i++) {
+    replayer.rewind();
+    frames += replayer.replay([&publisher, &bytes](int shard, gateway::Packet p) {
+      bytes += p.length;
+      if (p.op == 0) {
+        publisher.publish(std::move(p));
+      }
+    }, speed);
+  }
+
+  double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+  std::cout << "Replayed " << frames << " frames (" << bytes << " bytes) in " << seconds << "s, "
+            << frames / seconds << " frames/s" << std::endl;
+}